@@ -0,0 +1,515 @@
+/* KiloCycleS benchmark
+
+   Encodes synthetic payloads in memory, passes them through a simulated
+   channel and decodes them again, for each wave shape and demodulator.
+   Prints encode and decode throughput, heap allocations per payload byte
+   and the bit error rate, one line per run. Link with
+   -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc to count allocations;
+   see the bench target in the Makefile.
+
+   Built with -DKCS_BENCH_VORBIS and the Vorbis libraries, payloads up to
+   16 kB also go through an Ogg Vorbis round trip at a few bitrates
+   (channels ogg32 to ogg128), giving the error rate against bitrate.
+
+   USAGE
+    bench [payload bytes...] (Default: 4096 65536)
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#ifdef KCS_BENCH_VORBIS
+#include <vorbis/vorbisenc.h>
+#include <vorbis/vorbisfile.h>
+#endif
+
+#include "kcs.h"
+
+/* === ALLOCATION COUNTING === */
+
+static unsigned long bench_allocs = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count,size_t size);
+void *__real_realloc(void *p,size_t size);
+
+void *__wrap_malloc(size_t size){
+ bench_allocs++;
+ return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count,size_t size){
+ bench_allocs++;
+ return __real_calloc(count,size);
+}
+
+void *__wrap_realloc(void *p,size_t size){
+ bench_allocs++;
+ return __real_realloc(p,size);
+}
+
+/* === PAYLOADS AND CHANNELS === */
+
+static uint32_t bench_seed = 1;
+
+static uint32_t bench_random(void){
+ /* xorshift32, so every run sees the same payloads and noise */
+ bench_seed ^= bench_seed << 13;
+ bench_seed ^= bench_seed >> 17;
+ bench_seed ^= bench_seed << 5;
+ return bench_seed;
+}
+
+static double bench_gauss(void){
+ /* Near enough to a unit normal: the sum of four uniforms, rescaled */
+ int32_t sum = 0;
+ unsigned x;
+ 
+ for(x = 0;x < 4;x++)
+  sum += (int32_t)(bench_random() >> 16) - 32768;
+ return sum * (sqrt(0.75) / 32768);
+}
+
+#define PAYLOAD_TEXT 0
+#define PAYLOAD_RANDOM 1
+#define PAYLOAD_ZEROS 2
+
+static const char *payload_names[] = {"text","random","zeros"};
+
+static void bench_payload(char *payload,size_t length,int kind){
+ static const char *words[] = {
+  "lorem ","ipsum ","dolor ","sit ","amet, ","consectetur ",
+  "adipiscing ","elit.\n"
+ };
+ size_t pos = 0,word_length;
+ const char *word;
+ 
+ while(pos < length){
+  switch(kind){
+   case PAYLOAD_TEXT:
+    word = words[bench_random() % 8];
+    word_length = strlen(word);
+    if(word_length > length - pos)
+     word_length = length - pos;
+    memcpy(payload + pos,word,word_length);
+    pos += word_length;
+    break;
+   case PAYLOAD_RANDOM:
+    payload[pos++] = bench_random();
+    break;
+   default:
+    payload[pos++] = 0;
+    break;
+  }
+ }
+}
+
+#define CHANNEL_CLEAN 0
+#define CHANNEL_NOISE 1
+#define CHANNEL_QUIET 2
+#define CHANNEL_DRIFT 3
+#define CHANNEL_FADE 4
+#define CHANNEL_OGG32 5
+#define CHANNEL_OGG64 6
+#define CHANNEL_OGG128 7
+
+static const char *channel_names[] = {
+ "clean","noise","quiet","drift","fade","ogg32","ogg64","ogg128"
+};
+static const long channel_bitrates[] = {0,0,0,0,0,32000,64000,128000};
+
+#ifdef KCS_BENCH_VORBIS
+/* Ogg Vorbis encoded in memory and read back through vorbisfile */
+struct bench_ogg {
+ unsigned char *data;
+ size_t length,capacity,pos;
+};
+
+static int bench_ogg_write(struct bench_ogg *ogg,const ogg_page *page){
+ unsigned char *grown;
+ size_t length = page->header_len + page->body_len;
+ 
+ if(ogg->length + length > ogg->capacity){
+  ogg->capacity = (ogg->length + length) * 2;
+  if((grown = realloc(ogg->data,ogg->capacity)) == NULL)
+   return -1;
+  ogg->data = grown;
+ }
+ memcpy(ogg->data + ogg->length,page->header,page->header_len);
+ memcpy(ogg->data + ogg->length + page->header_len,page->body,
+  page->body_len);
+ ogg->length += length;
+ return 0;
+}
+
+static size_t bench_ogg_read(void *p,size_t size,size_t count,void *source){
+ struct bench_ogg *ogg = source;
+ size_t length = size * count;
+ 
+ if(length > ogg->length - ogg->pos)
+  length = ogg->length - ogg->pos;
+ memcpy(p,ogg->data + ogg->pos,length);
+ ogg->pos += length;
+ return length / size;
+}
+
+static int16_t *bench_vorbis(
+ const int16_t *data,
+ size_t data_length,
+ unsigned framerate,
+ long bitrate,
+ size_t *length
+){
+ static const ov_callbacks callbacks = {bench_ogg_read,NULL,NULL,NULL};
+ struct bench_ogg ogg = {NULL,0,0,0};
+ vorbis_info vi;
+ vorbis_comment vc;
+ vorbis_dsp_state vd;
+ vorbis_block vb;
+ ogg_stream_state os;
+ ogg_packet packet,header_comm,header_code;
+ ogg_page page;
+ OggVorbis_File vf;
+ int16_t *out = NULL;
+ size_t x,pos = 0,chunk;
+ float **pcm;
+ long got;
+ int section,error = 0;
+ 
+ vorbis_info_init(&vi);
+ if(vorbis_encode_init(&vi,1,framerate,-1,bitrate,-1) != 0){
+  vorbis_info_clear(&vi);
+  return NULL;
+ }
+ vorbis_comment_init(&vc);
+ vorbis_analysis_init(&vd,&vi);
+ vorbis_block_init(&vd,&vb);
+ ogg_stream_init(&os,1);
+ vorbis_analysis_headerout(&vd,&vc,&packet,&header_comm,&header_code);
+ ogg_stream_packetin(&os,&packet);
+ ogg_stream_packetin(&os,&header_comm);
+ ogg_stream_packetin(&os,&header_code);
+ while(ogg_stream_flush(&os,&page) > 0)
+  error |= bench_ogg_write(&ogg,&page);
+ 
+ /* A final empty write marks the end of the stream */
+ do{
+  chunk = (data_length - pos < 4096)?data_length - pos:4096;
+  if(chunk > 0){
+   pcm = vorbis_analysis_buffer(&vd,chunk);
+   for(x = 0;x < chunk;x++)
+    pcm[0][x] = data[pos + x] / 32768.0f;
+   pos += chunk;
+  }
+  vorbis_analysis_wrote(&vd,chunk);
+  while(vorbis_analysis_blockout(&vd,&vb) == 1){
+   vorbis_analysis(&vb,NULL);
+   vorbis_bitrate_addblock(&vb);
+   while(vorbis_bitrate_flushpacket(&vd,&packet)){
+    ogg_stream_packetin(&os,&packet);
+    while(ogg_stream_pageout(&os,&page) > 0)
+     error |= bench_ogg_write(&ogg,&page);
+   }
+  }
+ }while(chunk > 0);
+ ogg_stream_clear(&os);
+ vorbis_block_clear(&vb);
+ vorbis_dsp_clear(&vd);
+ vorbis_comment_clear(&vc);
+ vorbis_info_clear(&vi);
+ if(error || ov_open_callbacks(&ogg,&vf,NULL,0,callbacks) < 0){
+  free(ogg.data);
+  return NULL;
+ }
+ 
+ if((out = malloc(data_length * sizeof(*out) + 1)) != NULL){
+  pos = 0;
+  while(pos < data_length){
+   chunk = (data_length - pos < 4096)?data_length - pos:4096;
+   got = ov_read(&vf,(char *)(out + pos),chunk * sizeof(*out),
+    __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__,sizeof(*out),1,&section);
+   if(got == OV_HOLE)
+    continue;
+   if(got <= 0)
+    break;
+   pos += got / sizeof(*out);
+  }
+  *length = pos;
+ }
+ ov_clear(&vf);
+ free(ogg.data);
+ return out;
+}
+#endif
+
+static int16_t *bench_channel(
+ const int16_t *data,
+ size_t data_length,
+ int channel,
+ unsigned framerate,
+ size_t *length,
+ double *rate /* Input samples per output sample */
+){
+ /* Returns a copy of data as it comes out of the channel */
+ const double noise = 0.1 * INT16_MAX; /* Standard deviation */
+ const double gain = 0.4;
+ const double drift = 1.01; /* Recorder clock 1% slow */
+ const double fade = 0.05; /* Lowest gain, reached twice over the payload */
+ const double offset = 0.1 * INT16_MAX; /* DC offset while fading */
+ int16_t *out;
+ size_t x,out_length = data_length;
+ double sample,pos;
+ 
+ *rate = 1;
+ if(channel >= CHANNEL_OGG32){
+#ifdef KCS_BENCH_VORBIS
+  return bench_vorbis(data,data_length,framerate,channel_bitrates[channel],
+   length);
+#else
+  (void)framerate;
+  return NULL;
+#endif
+ }
+ if(channel == CHANNEL_DRIFT){
+  *rate = drift;
+  out_length = (data_length - 1) / drift;
+ }
+ if((out = malloc(out_length * sizeof(*out) + 1)) == NULL)
+  return NULL;
+ 
+ for(x = 0;x < out_length;x++){
+  switch(channel){
+   case CHANNEL_NOISE:
+    sample = data[x] + noise * bench_gauss();
+    break;
+   case CHANNEL_QUIET:
+    sample = data[x] * gain;
+    break;
+   case CHANNEL_FADE:
+    sample = data[x] * (fade + (1 - fade) *
+     (0.5 + 0.5 * cos(4 * M_PI * x / out_length))) + offset;
+    break;
+   case CHANNEL_DRIFT:
+    pos = x * drift;
+    sample = data[(size_t)pos] +
+     (data[(size_t)pos + 1] - data[(size_t)pos]) * (pos - (size_t)pos);
+    break;
+   default:
+    sample = data[x];
+    break;
+  }
+  out[x] = (sample > INT16_MAX)?INT16_MAX:
+   (sample < INT16_MIN)?INT16_MIN:(int16_t)lrint(sample);
+ }
+ *length = out_length;
+ return out;
+}
+
+/* === MEASUREMENT === */
+
+static double bench_now(void){
+ struct timespec ts;
+ 
+ clock_gettime(CLOCK_MONOTONIC,&ts);
+ return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench_errors(
+ const char *payload,
+ const size_t *payload_pos,
+ size_t payload_length,
+ const char *text,
+ const size_t *text_pos,
+ size_t text_length,
+ double rate,
+ size_t slack
+){
+ /* Counts bit errors, lining up each decoded byte with the payload byte
+    whose start bit it was found at. Lost and spurious bytes count as
+    eight errors each, so the rate is over the bits of both. */
+ size_t x = 0,y = 0,errors = 0,spurious = 0,pos;
+ 
+ while(x < payload_length || y < text_length){
+  pos = (y < text_length)?text_pos[y] * rate:(size_t)-1;
+  if(x < payload_length && payload_pos[x] + slack < pos){
+   errors += 8;
+   x++;
+  }else if(x >= payload_length || pos + slack < payload_pos[x]){
+   errors += 8;
+   spurious++;
+   y++;
+  }else{
+   errors += __builtin_popcount((unsigned char)(payload[x] ^ text[y]));
+   x++;
+   y++;
+  }
+ }
+ return (double)errors / ((payload_length + spurious) * 8);
+}
+
+static void bench_run(
+ const char *payload,
+ size_t payload_length,
+ int kind,
+ int wave,
+ int demodulator
+){
+ struct kcs_params params;
+ struct kcs_encoder enc;
+ struct kcs_decoder dec;
+ int16_t *data = NULL,*received = NULL;
+ size_t *payload_pos = NULL,*text_pos = NULL;
+ char *text = NULL,*block;
+ size_t data_length,received_length,text_length,pos,x;
+ unsigned window,block_length,block_text,ones;
+ uint64_t time;
+ unsigned long enc_allocs,dec_allocs;
+ double start,enc_time,dec_time,rate;
+ int channel,last_channel = CHANNEL_FADE;
+ 
+ kcs_params_default(&params);
+ params.null_cycles = 0;
+ params.leader = params.trailer = 1;
+ params.wave = wave;
+ params.demodulator = demodulator;
+ window = kcs_decode_window(&params);
+ 
+ /* Encoding, once per payload, through the streaming calls */
+ bench_allocs = 0;
+ start = bench_now();
+ if(kcs_encoder_init(&enc,&params) < 0)
+  return;
+ if(kcs_encoder_feed(&enc,payload,payload_length) < 0 ||
+  kcs_encoder_finish(&enc) < 0)
+  goto run_end;
+ data_length = enc.length;
+ if((data = malloc(data_length * sizeof(*data))) == NULL)
+  goto run_end;
+ kcs_encoder_pull(&enc,data,data_length);
+ enc_time = bench_now() - start;
+ enc_allocs = bench_allocs;
+ 
+ payload_pos = malloc(payload_length * sizeof(*payload_pos));
+ text = malloc(payload_length * 2 + 1);
+ text_pos = malloc((payload_length * 2 + 1) * sizeof(*text_pos));
+ if(payload_pos == NULL || text == NULL || text_pos == NULL)
+  goto run_end;
+ /* The payload follows the leader, and each byte starts on the first
+    sample at or after its start bit, times being in 2^-32 of a sample */
+ pos = (size_t)params.framerate * params.leader;
+ for(x = 0,time = 0;x < payload_length;x++){
+  payload_pos[x] = pos + ((time + UINT32_MAX) >> 32);
+  ones = __builtin_popcount((unsigned char)payload[x]) + 2;
+  time += ones * enc.bit_time[1] + (11 - ones) * enc.bit_time[0];
+ }
+ 
+ /* Vorbis is far slower than the modem, so only small payloads use it */
+#ifdef KCS_BENCH_VORBIS
+ if(payload_length <= 16384)
+  last_channel = CHANNEL_OGG128;
+#endif
+ for(channel = CHANNEL_CLEAN;channel <= last_channel;channel++){
+  received = bench_channel(data,data_length,channel,params.framerate,
+   &received_length,&rate);
+  if(received == NULL){
+   if(channel_bitrates[channel] == 0)
+    goto run_end;
+   printf("%-6s %-9s %-6s %7zu %-5s no Vorbis mode at this bitrate\n",
+    (wave == KCS_WAVE_SQUARE)?"square":"sine",
+    (demodulator == KCS_DEMOD_GOERTZEL)?"goertzel":"zerocross",
+    payload_names[kind],payload_length,channel_names[channel]);
+   continue;
+  }
+ 
+  /* Decoding, the same way kcs_decode_samples() walks a mapped file */
+  bench_allocs = 0;
+  start = bench_now();
+  if(kcs_decoder_init(&dec,&params) < 0)
+   goto run_end;
+  text_length = 0;
+  for(pos = 0;;pos += block_length){
+   block_length = (received_length - pos < window)?
+    received_length - pos:window;
+   if(block_length)
+    block = kcs_decode_block(&dec,received + pos,block_length,&block_text);
+   else
+    block = kcs_decode_end(&dec,&block_text);
+   for(x = 0;block && x < block_text && text_length < payload_length * 2 + 1;
+    x++){
+    text_pos[text_length] = dec.text_pos[x];
+    text[text_length++] = block[x];
+   }
+   if(block_length == 0)
+    break;
+  }
+  kcs_decoder_free(&dec);
+  dec_time = bench_now() - start;
+  dec_allocs = bench_allocs;
+ 
+  printf(
+   "%-6s %-9s %-6s %7zu %-5s %9.2f %9.1f %9.2f %9.1f %8.4f %8.4f %.6f\n",
+   (wave == KCS_WAVE_SQUARE)?"square":"sine",
+   (demodulator == KCS_DEMOD_GOERTZEL)?"goertzel":"zerocross",
+   payload_names[kind],
+   payload_length,
+   channel_names[channel],
+   data_length / enc_time / 1e6,
+   payload_length / enc_time / 1e3,
+   received_length / dec_time / 1e6,
+   payload_length / dec_time / 1e3,
+   (double)enc_allocs / payload_length,
+   (double)dec_allocs / payload_length,
+   bench_errors(payload,payload_pos,payload_length,text,text_pos,
+    text_length,rate,params.framerate / params.zero_freq / 2)
+  );
+  fflush(stdout);
+  free(received);
+  received = NULL;
+ }
+ 
+ run_end:
+ kcs_encoder_free(&enc);
+ free(data);
+ free(received);
+ free(payload_pos);
+ free(text);
+ free(text_pos);
+}
+
+int main(int argc,char *argv[]){
+ static const size_t default_sizes[] = {4096,65536};
+ size_t sizes[16];
+ unsigned size_count = 0,x;
+ int kind,wave,demodulator;
+ char *payload;
+ 
+ for(x = 1;x < (unsigned)argc && size_count < 16;x++)
+  if((sizes[size_count] = strtoul(argv[x],NULL,0)) > 0)
+   size_count++;
+ if(size_count == 0){
+  memcpy(sizes,default_sizes,sizeof(default_sizes));
+  size_count = 2;
+ }
+ 
+ printf("%-6s %-9s %-6s %7s %-5s %9s %9s %9s %9s %8s %8s %s\n",
+  "wave","engine","data","bytes","chan","enc Ms/s","enc kB/s",
+  "dec Ms/s","dec kB/s","enc a/B","dec a/B","BER");
+ for(x = 0;x < size_count;x++){
+  if((payload = malloc(sizes[x])) == NULL)
+   return 1;
+  for(kind = PAYLOAD_TEXT;kind <= PAYLOAD_ZEROS;kind++){
+   bench_seed = 1;
+   bench_payload(payload,sizes[x],kind);
+   for(wave = KCS_WAVE_SINE;wave <= KCS_WAVE_SQUARE;wave++)
+    for(demodulator = KCS_DEMOD_ZEROCROSS;demodulator <= KCS_DEMOD_GOERTZEL;
+     demodulator++)
+     bench_run(payload,sizes[x],kind,wave,demodulator);
+  }
+  free(payload);
+ }
+ return 0;
+}
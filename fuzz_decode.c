@@ -0,0 +1,112 @@
+/* KiloCycleS decoder fuzz target
+
+   libFuzzer entry point for kcs_decode_block() and the streaming decoder.
+   The first input byte picks the demodulator and squelch, the rest is
+   taken as S16LE samples and decoded from a local buffer, and then as
+   bytes for the FEC deframer.
+
+   libFuzzer: clang -fsanitize=fuzzer,address fuzz_decode.c libkcs.c -lm
+   AFL and replay: build with -DKCS_FUZZ_MAIN and pass the input on stdin.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "kcs.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *input,size_t input_length){
+ struct kcs_params params;
+ struct kcs_decoder dec;
+ struct kcs_fec_decoder fec;
+ int16_t *data;
+ char text[256],payload[256 + KCS_FEC_PAYLOAD];
+ size_t data_length,x;
+ unsigned window,block_length,text_length,y;
+ size_t last_pos = 0;
+ 
+ if(input_length < 1)
+  return 0;
+ kcs_params_default(&params);
+ params.demodulator = (input[0] & 1)?KCS_DEMOD_GOERTZEL:KCS_DEMOD_ZEROCROSS;
+ params.squelch = (input[0] >> 1) / 127.0;
+ 
+ data_length = (input_length - 1) / sizeof(*data);
+ if((data = malloc(data_length * sizeof(*data) + 1)) == NULL)
+  return 0;
+ for(x = 0;x < data_length;x++)
+  data[x] = input[1 + x * 2] | input[2 + x * 2] << 8;
+ if(kcs_decoder_init(&dec,&params) < 0){
+  free(data);
+  return 0;
+ }
+ 
+ /* Block calls, in windows shorter than the default so that the input
+    spans several, then the end of the stream. Bytes come out in order
+    and start within the samples given so far. */
+ window = kcs_decode_window(&params) / 8;
+ for(x = 0;x <= data_length;x += block_length){
+  block_length = (data_length - x < window)?data_length - x:window;
+  if(block_length){
+   if(kcs_decode_block(&dec,data + x,block_length,&text_length) == NULL)
+    break;
+  }else if(kcs_decode_end(&dec,&text_length) == NULL)
+   break;
+  for(y = 0;y < text_length;y++){
+   if(dec.text_pos[y] < last_pos || dec.text_pos[y] >= x + block_length)
+    abort();
+   last_pos = dec.text_pos[y];
+  }
+  if(block_length == 0)
+   break;
+ }
+ kcs_decoder_free(&dec);
+ 
+ /* The same samples through feed and pull */
+ if(kcs_decoder_init(&dec,&params) < 0){
+  free(data);
+  return 0;
+ }
+ kcs_decoder_feed(&dec,data,data_length);
+ kcs_decoder_finish(&dec);
+ while(kcs_decoder_pull(&dec,text,sizeof(text)) > 0);
+ kcs_decoder_free(&dec);
+ 
+ /* Payload never comes out longer than the bytes that framed it */
+ kcs_fec_decoder_init(&fec);
+ for(x = 1;x < input_length;x += block_length){
+  block_length = (input_length - x < 256)?input_length - x:256;
+  if(kcs_fec_deframe(&fec,(const char *)input + x,block_length,payload) >
+   block_length + KCS_FEC_PAYLOAD)
+   abort();
+ }
+ 
+ free(data);
+ return 0;
+}
+
+#ifdef KCS_FUZZ_MAIN
+int main(void){
+ uint8_t *input = NULL,*grown;
+ size_t input_length = 0,input_capacity = 0,read_length;
+ 
+ do{
+  if(input_length == input_capacity){
+   input_capacity = input_capacity * 2 + 65536;
+   if((grown = realloc(input,input_capacity)) == NULL){
+    free(input);
+    return 1;
+   }
+   input = grown;
+  }
+  read_length = fread(input + input_length,1,input_capacity - input_length,
+   stdin);
+  input_length += read_length;
+ }while(read_length > 0);
+ 
+ LLVMFuzzerTestOneInput(input,input_length);
+ free(input);
+ return 0;
+}
+#endif
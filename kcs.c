@@ -14,10 +14,7 @@
     http://en.wikipedia.org/wiki/Kansas_City_standard
     
    TODO
-    - fix decoding issue
-    - FLAC decoding function
     - FLAC error checking
-    - nonstandard options/presets
     - cleanup
     
    CHANGES
@@ -28,10 +25,20 @@
 */
 
 #include <unistd.h>
+#include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <math.h>
+#include <strings.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <pulse/simple.h>
 #include <pulse/error.h>
@@ -43,7 +50,12 @@
 #include <FLAC/stream_decoder.h>
 #include <FLAC/stream_encoder.h>
 
+#include "kcs.h"
+
 #define ENC_BLOCKSIZE 128
+#define ENC_BUFFERSIZE KCS_FEC_FRAME /* A block, or a frame of one with -F */
+#define ENC_CHUNKSIZE 16384 /* Samples synthesised and written at a time */
+#define KCS_CHANNELS_MAX 8
 
 int max(int x,int y){
  return (x > y)?x:y;
@@ -53,201 +65,636 @@ int min(int x,int y){
  return (x < y)?x:y;
 }
 
-typedef int16_t * (*wave_function)(unsigned,unsigned,unsigned *);
-static unsigned KCS_FRAMERATE = 44100;
-static unsigned KCS_ONES_FREQ = 2400;
-static unsigned KCS_ZERO_FREQ = 1200;
-static unsigned KCS_ONES_CYCLES = 2;
-static unsigned KCS_ZERO_CYCLES = 1;
-static unsigned KCS_NULL_CYCLES = 800;
-static double KCS_AMPLITUDE = 0.8;
-static double KCS_SQUELCH = 0.25;
-static unsigned KCS_LEADER = 5;
-static unsigned KCS_TRAILER = 5;
-
-int16_t *kcs_encode_sine(unsigned freq,unsigned cycles,unsigned *length){
- const double start_phase = M_PI_2;
- unsigned cycle_length = KCS_FRAMERATE / freq;
- unsigned data_length = cycle_length * cycles;
- unsigned x;
- int16_t *data = NULL;
+static unsigned KCS_THREADS = 1;
+static long KCS_BITRATE = 64000; /* Ogg Vorbis nominal bit/s */
+static unsigned KCS_LATENCY = 20; /* Sound card buffering in ms */
+static int KCS_FRAMED = 0; /* FEC frames around the bytes */
+static unsigned KCS_CHANNELS = 1; /* Streams side by side, one a channel */
+
+/* === STATISTICS ===
+   Built with KCS_STATS, the encoder's synthesis and sink writes are
+   counted and timed here, from whichever threads they run on, and each
+   decoder's own counts (see kcs.h) are added in as it finishes. -v and
+   --stats=json report them at the end, and every KCS_STATS_PERIOD
+   seconds of audio when decoding from the soundcard. */
+#define KCS_REPORT_TEXT 1
+#define KCS_REPORT_JSON 2
+#define KCS_STATS_PERIOD 5
+
+static int KCS_REPORT = 0; /* KCS_REPORT_TEXT or KCS_REPORT_JSON */
+
+struct kcs_totals {
+ struct kcs_stats dec;
+ uint64_t encoded; /* Bytes synthesised */
+ uint64_t synthesized; /* Samples of them */
+ uint64_t writes; /* Sink calls */
+ uint64_t written; /* Frames given to the sink */
+ uint64_t synthesis_ns,sink_ns;
+};
+
+static struct kcs_totals kcs_totals;
+static double kcs_started;
+
+static double kcs_seconds(void){
+ struct timespec ts;
+ 
+ clock_gettime(CLOCK_MONOTONIC,&ts);
+ return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#ifdef KCS_STATS
+#define KCS_TALLY(field,n) \
+ __atomic_fetch_add(&kcs_totals.field,(n),__ATOMIC_RELAXED)
+#define KCS_STOPWATCH(watch) uint64_t watch = kcs_nanoseconds()
+#define KCS_LAP(field,watch) kcs_lap(&kcs_totals.field,&(watch))
+#define KCS_STATS_BUILT kcs_stats_enabled()
+
+static uint64_t kcs_nanoseconds(void){
+ struct timespec ts;
+ 
+ clock_gettime(CLOCK_MONOTONIC,&ts);
+ return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void kcs_lap(uint64_t *field,uint64_t *watch){
+ uint64_t now = kcs_nanoseconds();
+ 
+ __atomic_fetch_add(field,now - *watch,__ATOMIC_RELAXED);
+ *watch = now;
+}
+#else
+#define KCS_TALLY(field,n) ((void)0)
+#define KCS_STOPWATCH(watch)
+#define KCS_LAP(field,watch) ((void)0)
+#define KCS_STATS_BUILT 0
+#endif
+
+static void kcs_decoder_tally(struct kcs_decoder *dec){
+ /* Moves a decoder's counts into the totals; struct kcs_stats is all
+    uint64_t, so it is added up as an array of them */
+ uint64_t *from = (uint64_t *)&dec->stats;
+ uint64_t *to = (uint64_t *)&kcs_totals.dec;
+ size_t x;
+ 
+ for(x = 0;x < sizeof(dec->stats) / sizeof(*from);x++)
+  __atomic_fetch_add(&to[x],from[x],__ATOMIC_RELAXED);
+ memset(&dec->stats,0,sizeof(dec->stats));
+}
+
+/* Sample sinks take a block of frames of KCS_CHANNELS interleaved samples
+   and return a negative value on error. Samples are int16_t, or int32_t
+   for sinks that ask kcs_encode_stream() for them so that they need no
+   conversion copy of their own. */
+typedef int (*sample_sink)(void *,void *,unsigned);
+
+static int kcs_sink_write(
+ sample_sink sink,
+ void *sink_data,
+ void *buffer,
+ unsigned length
+){
+ int ret;
+ KCS_STOPWATCH(watch);
+ 
+ ret = sink(sink_data,buffer,length);
+ KCS_TALLY(writes,1);
+ KCS_TALLY(written,length);
+ KCS_LAP(sink_ns,watch);
+ return ret;
+}
+
+static unsigned kcs_read_block(FILE *ip,char *block,unsigned *sequence){
+ /* Reads the next block of input, or with -F the next frame's payload
+    and frames it */
+ char payload[KCS_FEC_PAYLOAD];
+ unsigned length;
+ 
+ if(!KCS_FRAMED)
+  return fread(block,sizeof(*block),ENC_BLOCKSIZE,ip);
+ if((length = fread(payload,sizeof(*payload),KCS_FEC_PAYLOAD,ip)) == 0)
+  return 0;
+ return kcs_fec_frame(payload,length,(*sequence)++,block);
+}
+
+static unsigned kcs_pull_samples(
+ struct kcs_encoder *enc,
+ void *data, /* ENC_CHUNKSIZE samples */
+ size_t sample_size
+){
+ /* Wide sinks get the samples widened from a chunk of them */
+ int16_t chunk[ENC_CHUNKSIZE];
+ unsigned length;
+ KCS_STOPWATCH(watch);
+ 
+ if(sample_size == sizeof(int32_t)){
+  length = kcs_encoder_pull(enc,chunk,ENC_CHUNKSIZE);
+  kcs_widen(chunk,data,length);
+ }else
+  length = kcs_encoder_pull(enc,data,ENC_CHUNKSIZE);
+ KCS_TALLY(synthesized,length);
+ KCS_LAP(synthesis_ns,watch);
+ return length;
+}
+
+/* === ENCODER PIPELINE ===
+   With more than one thread, the input is read and synthesised on a
+   thread of its own while the calling thread feeds the sink. Chunks pass
+   through a single-producer single-consumer ring of reusable buffers;
+   only the producer moves head and only the consumer moves tail, so the
+   two never take a lock. */
+#define KCS_RING_SLOTS 16
+
+struct kcs_ring_slot {
+ void *data;
+ unsigned length,capacity;
+};
+
+struct kcs_encode_pipe {
+ struct kcs_encoder enc; /* The producer's */
+ FILE *ip;
+ size_t sample_size;
+ struct kcs_ring_slot slot[KCS_RING_SLOTS];
+ unsigned head,tail;
+ int done,error,abort;
+};
+
+static void kcs_ring_wait(unsigned spins){
+ /* Backs off from yielding to sleeping while the other side catches up */
+ if(spins < 64)
+  sched_yield();
+ else
+  usleep(100);
+}
+
+static struct kcs_ring_slot *kcs_ring_acquire(
+ struct kcs_encode_pipe *pipe,
+ unsigned length
+){
+ /* Waits for a free slot and makes it hold at least length samples */
+ struct kcs_ring_slot *slot;
+ unsigned spins = 0;
  
- if(data_length == 0){
-  *length = 0;
-  data = malloc(1);
-  return data;
+ while(pipe->head - __atomic_load_n(&pipe->tail,__ATOMIC_ACQUIRE) ==
+  KCS_RING_SLOTS){
+  if(__atomic_load_n(&pipe->abort,__ATOMIC_RELAXED))
+   return NULL;
+  kcs_ring_wait(spins++);
  }
+ slot = &pipe->slot[pipe->head % KCS_RING_SLOTS];
+ if(length > slot->capacity){
+  free(slot->data);
+  slot->capacity = 0;
+  if((slot->data = malloc(length * pipe->sample_size)) == NULL)
+   return NULL;
+  slot->capacity = length;
+ }
+ return slot;
+}
+
+static void kcs_ring_publish(struct kcs_encode_pipe *pipe){
+ __atomic_store_n(&pipe->head,pipe->head + 1,__ATOMIC_RELEASE);
+}
+
+static int kcs_produce(struct kcs_encode_pipe *pipe,size_t least){
+ /* Synthesises into the ring until fewer than least samples are ready */
+ struct kcs_ring_slot *slot;
  
- data = malloc(data_length * sizeof(*data));
- for(x = 0;x < cycle_length;x++){
-  /* If amplitude is greater than 1.0, clip the sin wave */
-  data[x] = 
-   fmax(
-    fmin(
-     KCS_AMPLITUDE*sin(2 * M_PI * x / cycle_length + start_phase),
-     1.0
-    ),
-    -1.0
-   )*INT16_MAX;
+ while(pipe->enc.length >= least){
+  if((slot = kcs_ring_acquire(pipe,ENC_CHUNKSIZE)) == NULL)
+   return -1;
+  slot->length = kcs_pull_samples(&pipe->enc,slot->data,pipe->sample_size);
+  kcs_ring_publish(pipe);
  }
- for(;x < data_length;x += cycle_length)
-  memcpy(data + x,data,cycle_length * sizeof(*data));
+ return 0;
+}
+
+static void *kcs_encode_produce(void *arg){
+ struct kcs_encode_pipe *pipe = arg;
+ char block[ENC_BUFFERSIZE];
+ unsigned block_length,sequence = 0;
  
- *length = data_length;
- return data;
+ while(!feof(pipe->ip) && !ferror(pipe->ip)){
+  block_length = kcs_read_block(pipe->ip,block,&sequence);
+  if(kcs_encoder_feed(&pipe->enc,block,block_length) < 0)
+   goto produce_error;
+  KCS_TALLY(encoded,block_length);
+  if(kcs_produce(pipe,ENC_CHUNKSIZE) < 0)
+   goto produce_error;
+ }
+ 
+ if(kcs_encoder_finish(&pipe->enc) < 0 || kcs_produce(pipe,1) < 0)
+  goto produce_error;
+ 
+ __atomic_store_n(&pipe->done,1,__ATOMIC_RELEASE);
+ return NULL;
+ produce_error:
+ __atomic_store_n(&pipe->error,1,__ATOMIC_RELAXED);
+ __atomic_store_n(&pipe->done,1,__ATOMIC_RELEASE);
+ return NULL;
 }
 
-int16_t *kcs_encode_square(unsigned freq,unsigned cycles,unsigned *length){
- unsigned x;
- unsigned cycle_length = KCS_FRAMERATE/freq;
- int16_t *data = NULL;
- unsigned data_length = cycle_length * cycles;
+static int kcs_encode_pipeline(
+ const struct kcs_encoder *enc,
+ FILE *ip,
+ size_t sample_size,
+ sample_sink sink,
+ void *sink_data
+){
+ struct kcs_encode_pipe pipe;
+ struct kcs_ring_slot *slot;
+ pthread_t tid;
+ unsigned x,spins;
+ int ret = 0;
  
- if(data_length == 0){
-  *length = 0;
-  data = malloc(1);
-  return data;
+ memset(&pipe,0,sizeof(pipe));
+ pipe.ip = ip;
+ pipe.sample_size = sample_size;
+ kcs_encoder_share(&pipe.enc,enc);
+ if(pthread_create(&tid,NULL,kcs_encode_produce,&pipe)){
+  kcs_encoder_free(&pipe.enc);
+  return -1;
  }
  
- data = malloc(data_length * sizeof(*data));
- for(x = 0;x < cycle_length / 2;x++)
-  data[x] = fmin(1.0,fmax(0.0,KCS_AMPLITUDE)) * INT16_MAX;
- for(;x < cycle_length;x++)
-  data[x] = 0 - fmin(1.0,fmax(0.0,KCS_AMPLITUDE)) * INT16_MAX;
- for(x = 1;x < cycles;x++)
-  memcpy(data + x * cycle_length,data,cycle_length * sizeof(*data));
- *length = data_length;
- return data;
+ for(;;){
+  for(spins = 0;pipe.tail == __atomic_load_n(&pipe.head,__ATOMIC_ACQUIRE);){
+   /* done is set after the last publish, so look at head once more */
+   if(
+    __atomic_load_n(&pipe.done,__ATOMIC_ACQUIRE) &&
+    pipe.tail == __atomic_load_n(&pipe.head,__ATOMIC_ACQUIRE)
+   )
+    goto pipeline_end;
+   kcs_ring_wait(spins++);
+  }
+  slot = &pipe.slot[pipe.tail % KCS_RING_SLOTS];
+  if(kcs_sink_write(sink,sink_data,slot->data,slot->length) < 0){
+   __atomic_store_n(&pipe.abort,1,__ATOMIC_RELAXED);
+   ret = -1;
+   break;
+  }
+  __atomic_store_n(&pipe.tail,pipe.tail + 1,__ATOMIC_RELEASE);
+ }
+ 
+ pipeline_end:
+ pthread_join(tid,NULL);
+ if(pipe.error)
+  ret = -1;
+ for(x = 0;x < KCS_RING_SLOTS;x++)
+  free(pipe.slot[x].data);
+ kcs_encoder_free(&pipe.enc);
+ return ret;
 }
 
-static wave_function kcs_encode_wave = kcs_encode_sine;
+/* === CHANNELS ===
+   With -c each channel carries a KCS stream of its own, synthesised by an
+   encoder of its own and interleaved a chunk of frames at a time. The
+   channels read their next block in turn, so an input they all share is
+   striped across them a block at a time. A channel that ends before the
+   others is padded with silence. */
+#define KCS_CHANNEL_CHUNK 4096 /* Frames interleaved at a time */
 
-int16_t *kcs_encode_carrier(unsigned seconds,unsigned *length){
- int16_t *data;
- unsigned data_length;
- 
- data = kcs_encode_wave(KCS_ONES_FREQ,seconds*KCS_ONES_FREQ,&data_length);
- (*length) = data_length;
- return data;
-}
-
-int16_t *kcs_encode_block(
- char *block,
- unsigned block_length,
- unsigned *length
-){
- unsigned x,y,pos = 0;
- int16_t *data = NULL;
- unsigned data_length = 0;
- int16_t *one_pulse;
- unsigned one_length;
- int16_t *zero_pulse;
- unsigned zero_length;
- int16_t *null_pulse;
- unsigned null_length;
-
- one_pulse = kcs_encode_wave(KCS_ONES_FREQ,KCS_ONES_CYCLES,&one_length);
- zero_pulse = kcs_encode_wave(KCS_ZERO_FREQ,KCS_ZERO_CYCLES,&zero_length);
- null_pulse = kcs_encode_wave(KCS_ONES_FREQ,KCS_NULL_CYCLES,&null_length);
- 
- /* Generate data */
- for(y=0;y<block_length;y++){
-  
-  data = realloc(data,(data_length += zero_length) * sizeof(*data));
-  memcpy(data + pos,zero_pulse,zero_length * sizeof(*data));
-  pos += zero_length;
-  
-  for(x = 0x1;x <= 0x80;x <<= 1){
-   if(block[y] & x){
-    data = realloc(data,(data_length += one_length) * sizeof(*data));
-    memcpy(data + pos,one_pulse,one_length * sizeof(*data));
-    pos += one_length;
-   }else{
-    data = realloc(data,(data_length += zero_length) * sizeof(*data));
-    memcpy(data + pos,zero_pulse,zero_length * sizeof(*data));
-    pos += zero_length;
+static int kcs_encode_channels(
+ const struct kcs_encoder *shared,
+ FILE **ip,
+ size_t sample_size,
+ sample_sink sink,
+ void *sink_data
+){
+ struct kcs_encoder enc[KCS_CHANNELS_MAX];
+ int16_t split[KCS_CHANNEL_CHUNK];
+ char block[ENC_BUFFERSIZE];
+ unsigned sequence[KCS_CHANNELS_MAX];
+ int finished[KCS_CHANNELS_MAX];
+ void *buffer;
+ unsigned x,y,ready,length,block_length,channels = 0;
+ int low,ret = -1;
+ 
+ if((buffer = malloc(KCS_CHANNEL_CHUNK * KCS_CHANNELS * sample_size)) == NULL)
+  return -1;
+ for(;channels < KCS_CHANNELS;channels++){
+  kcs_encoder_share(&enc[channels],shared);
+  sequence[channels] = 0;
+  finished[channels] = 0;
+ }
+ 
+ for(;;){
+  /* A block for each channel in turn, while any channel still reading
+     has less than a chunk ready */
+  for(;;){
+   for(low = 0,x = 0;x < KCS_CHANNELS;x++)
+    low |= !finished[x] && enc[x].length < KCS_CHANNEL_CHUNK;
+   if(!low)
+    break;
+   for(x = 0;x < KCS_CHANNELS;x++){
+    if(finished[x])
+     continue;
+    if((block_length = kcs_read_block(ip[x],block,&sequence[x])) == 0){
+     finished[x] = 1;
+     if(kcs_encoder_finish(&enc[x]) < 0)
+      goto channels_end;
+     continue;
+    }
+    if(kcs_encoder_feed(&enc[x],block,block_length) < 0)
+     goto channels_end;
+    KCS_TALLY(encoded,block_length);
    }
   }
-  
-  if(block[y] == '\n' && null_length){
-   data = realloc(data,(data_length += null_length) * sizeof(*data));
-   memcpy(data + pos,null_pulse,null_length * sizeof(*data));
-   pos += null_length;
+ 
+  for(ready = 0,x = 0;x < KCS_CHANNELS;x++)
+   ready = max(ready,min(enc[x].length,KCS_CHANNEL_CHUNK));
+  if(ready == 0)
+   break;
+  for(x = 0;x < KCS_CHANNELS;x++){
+   KCS_STOPWATCH(watch);
+   length = kcs_encoder_pull(&enc[x],split,ready);
+   KCS_TALLY(synthesized,length);
+   KCS_LAP(synthesis_ns,watch);
+   memset(split + length,0,(ready - length) * sizeof(*split));
+   if(sample_size == sizeof(int32_t))
+    for(y = 0;y < ready;y++)
+     ((int32_t *)buffer)[y * KCS_CHANNELS + x] = split[y];
+   else
+    for(y = 0;y < ready;y++)
+     ((int16_t *)buffer)[y * KCS_CHANNELS + x] = split[y];
   }
-  
-  data = realloc(data,(data_length += one_length * 2) * sizeof(*data));
-  memcpy(data + pos,one_pulse,one_length * sizeof(*data));
-  pos += one_length;
-  memcpy(data + pos,one_pulse,one_length * sizeof(*data));
-  pos += one_length;
+  if(kcs_sink_write(sink,sink_data,buffer,ready) < 0)
+   goto channels_end;
  }
+ ret = 0;
+ 
+ channels_end:
+ for(x = 0;x < channels;x++)
+  kcs_encoder_free(&enc[x]);
+ free(buffer);
+ return ret;
+}
+
+static int kcs_input_open(FILE **ip,char **names,unsigned count){
+ /* Opens a file for each channel, or one or stdin for all of them */
+ unsigned x;
  
- free(one_pulse);
- free(zero_pulse);
- free(null_pulse);
- *length = data_length;
- return data;
+ for(x = 0;x < KCS_CHANNELS;x++){
+  if(x > 0 && count < 2)
+   ip[x] = ip[0];
+  else if(count == 0)
+   ip[x] = stdin;
+  else if((ip[x] = fopen(names[x],"rb")) == NULL){
+   perror(names[x]);
+   while(x--)
+    fclose(ip[x]);
+   return -1;
+  }
+ }
+ return 0;
+}
+
+static int kcs_encode_write(
+ struct kcs_encoder *enc,
+ size_t least,
+ void *buffer, /* ENC_CHUNKSIZE samples */
+ size_t sample_size,
+ sample_sink sink,
+ void *sink_data
+){
+ /* Writes chunks to the sink until fewer than least samples are ready */
+ while(enc->length >= least)
+  if(kcs_sink_write(sink,sink_data,buffer,
+   kcs_pull_samples(enc,buffer,sample_size)) < 0)
+   return -1;
+ return 0;
+}
+
+int kcs_encode_stream(
+ const struct kcs_encoder *enc,
+ FILE **ip, /* One for each channel, which may all be the same */
+ size_t sample_size, /* sizeof(int16_t) or sizeof(int32_t) */
+ sample_sink sink,
+ void *sink_data
+){
+ struct kcs_encoder stream;
+ char block[ENC_BUFFERSIZE];
+ void *buffer;
+ unsigned block_length,sequence = 0;
+ int ret = -1;
+ 
+ if(KCS_CHANNELS > 1)
+  return kcs_encode_channels(enc,ip,sample_size,sink,sink_data);
+ if(KCS_THREADS > 1)
+  return kcs_encode_pipeline(enc,ip[0],sample_size,sink,sink_data);
+ 
+ kcs_encoder_share(&stream,enc);
+ if((buffer = malloc(ENC_CHUNKSIZE * sample_size)) == NULL)
+  goto encode_end;
+ 
+ while(!feof(ip[0]) && !ferror(ip[0])){
+  block_length = kcs_read_block(ip[0],block,&sequence);
+  if(kcs_encoder_feed(&stream,block,block_length) < 0)
+   goto encode_end;
+  KCS_TALLY(encoded,block_length);
+  if(kcs_encode_write(&stream,ENC_CHUNKSIZE,buffer,sample_size,sink,
+   sink_data) < 0)
+   goto encode_end;
+ }
+ 
+ if(
+  kcs_encoder_finish(&stream) < 0 ||
+  kcs_encode_write(&stream,1,buffer,sample_size,sink,sink_data) < 0
+ )
+  goto encode_end;
+ ret = 0;
+ 
+ encode_end:
+ kcs_encoder_free(&stream);
+ free(buffer);
+ return ret;
 }
 
-void kcs_encode_flac(FILE *ip,char *out){
+static int kcs_flac_sink(void *sink_data,void *buffer,unsigned length){
+ /* Samples arrive as FLAC__int32 already, see kcs_encode_flac() */
+ FLAC__StreamEncoder *encoder = sink_data;
+ 
+ if(length == 0)
+  return 0;
+ return FLAC__stream_encoder_process_interleaved(encoder,buffer,length)?0:-1;
+}
+
+int kcs_encode_flac(const struct kcs_encoder *enc,FILE **ip,char *out){
  FLAC__StreamEncoder *encoder;
- char block[ENC_BLOCKSIZE];
- unsigned block_length,length,x;
- int16_t *buffer;
- FLAC__int32 *pcm;
+ int error = 0;
  
  encoder = FLAC__stream_encoder_new();
- FLAC__stream_encoder_set_channels(encoder,1);
- FLAC__stream_encoder_set_sample_rate(encoder,KCS_FRAMERATE);
- FLAC__stream_encoder_set_bits_per_sample(encoder,sizeof(*buffer)*8);
+ FLAC__stream_encoder_set_channels(encoder,KCS_CHANNELS);
+ FLAC__stream_encoder_set_sample_rate(encoder,enc->params.framerate);
+ FLAC__stream_encoder_set_bits_per_sample(encoder,sizeof(int16_t)*8);
  FLAC__stream_encoder_set_compression_level(encoder,8);
+#if FLAC_API_VERSION_CURRENT >= 14
+ /* libFLAC 1.5 can compress frames on threads of its own */
+ if(KCS_THREADS > 1)
+  FLAC__stream_encoder_set_num_threads(encoder,KCS_THREADS);
+#endif
  FLAC__stream_encoder_init_file(encoder,out,NULL,NULL);
  
- buffer = kcs_encode_carrier(KCS_LEADER,&length);
- pcm = malloc(length*sizeof(*pcm));
- for(x=0;x<length;x++)
-  pcm[x] = buffer[x];
- FLAC__stream_encoder_process_interleaved(encoder,pcm,length);
- free(buffer);
- free(pcm);
- 
- while(!feof(ip) && !ferror(ip)){
-  block_length = fread(block,sizeof(*block),ENC_BLOCKSIZE,ip);
-  buffer = kcs_encode_block(block,block_length,&length);
-  pcm = malloc(length*sizeof(*pcm));
-  for(x=0;x<length;x++)
-   pcm[x] = buffer[x];
-  FLAC__stream_encoder_process_interleaved(encoder,pcm,length);
-  free(buffer);
-  free(pcm);
- }
- 
- buffer = kcs_encode_carrier(KCS_TRAILER,&length);
- pcm = malloc(length*sizeof(*pcm));
- for(x=0;x<length;x++)
-  pcm[x] = buffer[x];
- FLAC__stream_encoder_process_interleaved(encoder,pcm,length);
- free(buffer);
- free(pcm);
+ if(kcs_encode_stream(enc,ip,sizeof(FLAC__int32),kcs_flac_sink,encoder) < 0){
+  fprintf(stderr,"Error: %s\n",FLAC__StreamEncoderStateString[
+   FLAC__stream_encoder_get_state(encoder)]);
+  error = -1;
+ }
  
- FLAC__stream_encoder_finish(encoder);
+ if(!FLAC__stream_encoder_finish(encoder))
+  error = -1;
  FLAC__stream_encoder_delete(encoder);
  
+ return error;
 }
 
-void kcs_encode_pa(FILE *ip){
- char block[ENC_BLOCKSIZE];
- int16_t *buffer;
- unsigned block_length,length;
- static pa_sample_spec ss;
- pa_simple *s = NULL;
+/* Ogg Vorbis encoding at a managed average bitrate. libvorbisenc only has
+   modes for some bitrates at each sample rate, so -b is checked up front. */
+struct kcs_ogg_client {
+ FILE *op;
+ ogg_stream_state os;
+ vorbis_info vi;
+ vorbis_comment vc;
+ vorbis_dsp_state vd;
+ vorbis_block vb;
+};
+
+static int kcs_ogg_page(struct kcs_ogg_client *client,ogg_page *page){
+ if(
+  fwrite(page->header,1,page->header_len,client->op) !=
+   (size_t)page->header_len ||
+  fwrite(page->body,1,page->body_len,client->op) != (size_t)page->body_len
+ )
+  return -1;
+ return 0;
+}
+
+static int kcs_ogg_drain(struct kcs_ogg_client *client){
+ /* Writes out every page the samples analysed so far make up */
+ ogg_packet packet;
+ ogg_page page;
+ 
+ while(vorbis_analysis_blockout(&client->vd,&client->vb) == 1){
+  vorbis_analysis(&client->vb,NULL);
+  vorbis_bitrate_addblock(&client->vb);
+  while(vorbis_bitrate_flushpacket(&client->vd,&packet)){
+   ogg_stream_packetin(&client->os,&packet);
+   while(ogg_stream_pageout(&client->os,&page) > 0)
+    if(kcs_ogg_page(client,&page) < 0)
+     return -1;
+  }
+ }
+ return 0;
+}
+
+static int kcs_ogg_sink(void *sink_data,void *samples,unsigned length){
+ struct kcs_ogg_client *client = sink_data;
+ const int16_t *buffer = samples;
+ float **pcm;
+ unsigned x,y;
+ 
+ if(length == 0)
+  return 0;
+ pcm = vorbis_analysis_buffer(&client->vd,length);
+ for(y = 0;y < KCS_CHANNELS;y++)
+  for(x = 0;x < length;x++)
+   pcm[y][x] = buffer[x * KCS_CHANNELS + y] / 32768.0f;
+ vorbis_analysis_wrote(&client->vd,length);
+ return kcs_ogg_drain(client);
+}
+
+int kcs_encode_ogg(const struct kcs_encoder *enc,FILE **ip,char *out){
+ struct kcs_ogg_client client;
+ ogg_packet header,header_comm,header_code;
+ ogg_page page;
+ int error = 0;
+ 
+ vorbis_info_init(&client.vi);
+ if(vorbis_encode_init(&client.vi,KCS_CHANNELS,enc->params.framerate,
+  -1,KCS_BITRATE,-1) != 0){
+  fprintf(stderr,"Error: Vorbis has no mode for %ld bit/s at %u Hz\n",
+   KCS_BITRATE,enc->params.framerate);
+  vorbis_info_clear(&client.vi);
+  return -1;
+ }
+ if((client.op = fopen(out,"wb")) == NULL){
+  perror(out);
+  vorbis_info_clear(&client.vi);
+  return -1;
+ }
+ vorbis_comment_init(&client.vc);
+ vorbis_comment_add_tag(&client.vc,"ENCODER","KiloCycleS");
+ vorbis_analysis_init(&client.vd,&client.vi);
+ vorbis_block_init(&client.vd,&client.vb);
+ ogg_stream_init(&client.os,getpid());
+ 
+ /* The three header packets go on pages of their own */
+ vorbis_analysis_headerout(&client.vd,&client.vc,
+  &header,&header_comm,&header_code);
+ ogg_stream_packetin(&client.os,&header);
+ ogg_stream_packetin(&client.os,&header_comm);
+ ogg_stream_packetin(&client.os,&header_code);
+ while(ogg_stream_flush(&client.os,&page) > 0)
+  if(kcs_ogg_page(&client,&page) < 0)
+   goto encode_error;
+ 
+ if(kcs_encode_stream(enc,ip,sizeof(int16_t),kcs_ogg_sink,&client) < 0)
+  goto encode_error;
+ /* End of stream */
+ vorbis_analysis_wrote(&client.vd,0);
+ if(kcs_ogg_drain(&client) < 0)
+  goto encode_error;
+ goto encode_end;
+ 
+ encode_error:
+ perror(out);
+ error = -1;
+ encode_end:
+ ogg_stream_clear(&client.os);
+ vorbis_block_clear(&client.vb);
+ vorbis_dsp_clear(&client.vd);
+ vorbis_comment_clear(&client.vc);
+ vorbis_info_clear(&client.vi);
+ if(fclose(client.op) != 0)
+  error = -1;
+ return error;
+}
+
+struct kcs_pa_client {
+ pa_simple *s;
  int err;
+};
+
+static pa_buffer_attr kcs_pa_attr(const pa_sample_spec *ss){
+ /* Asks the server to buffer KCS_LATENCY ms each way, which is also the
+    size of each read when recording */
+ pa_buffer_attr attr;
+ 
+ attr.maxlength = (uint32_t)-1;
+ attr.prebuf = (uint32_t)-1;
+ attr.minreq = (uint32_t)-1;
+ attr.tlength = attr.fragsize =
+  pa_usec_to_bytes((pa_usec_t)KCS_LATENCY * 1000,ss);
+ return attr;
+}
+
+static int kcs_pa_sink(void *sink_data,void *buffer,unsigned length){
+ struct kcs_pa_client *client = sink_data;
+ 
+ return pa_simple_write(client->s,buffer,
+  (size_t)length * KCS_CHANNELS * sizeof(int16_t),&client->err);
+}
+
+int kcs_encode_pa(const struct kcs_encoder *enc,FILE **ip){
+ static pa_sample_spec ss;
+ pa_buffer_attr attr;
+ struct kcs_pa_client client;
  
  ss.format = PA_SAMPLE_S16LE;
- ss.rate = KCS_FRAMERATE;
- ss.channels = 1;
+ ss.rate = enc->params.framerate;
+ ss.channels = KCS_CHANNELS;
+ attr = kcs_pa_attr(&ss);
  
- if(!(s = pa_simple_new(
+ client.err = 0;
+ if(!(client.s = pa_simple_new(
   NULL,
   "KiloCycleS",
   PA_STREAM_PLAYBACK,
@@ -255,242 +702,1132 @@ void kcs_encode_pa(FILE *ip){
   "Encoding",
   &ss,
   NULL,
-  NULL,
-  &err
+  &attr,
+  &client.err
  )))
   goto encode_error;
  
- buffer = kcs_encode_carrier(KCS_LEADER,&length);
- if(pa_simple_write(s,buffer,length * sizeof(*buffer),&err) < 0)
+ if(kcs_encode_stream(enc,ip,sizeof(int16_t),kcs_pa_sink,&client) < 0)
   goto encode_error;
- free(buffer);
  
- while(!ferror(ip) && !feof(ip)){
-  block_length = fread(block,1,ENC_BLOCKSIZE,ip);
-  buffer = kcs_encode_block(block,block_length,&length);
-  if(pa_simple_write(s,buffer,length * sizeof(*buffer),&err) < 0)
-   goto encode_error;
-  free(buffer);
+ if(pa_simple_drain(client.s,&client.err) < 0)
+  goto encode_error;
+ pa_simple_free(client.s);
+ 
+ return 0;
+ encode_error:
+ fprintf(stderr,"Error: %s\n",pa_strerror(client.err));
+ if(client.s)
+  pa_simple_free(client.s);
+ return -1;
+}
+
+/* === FILE BACKENDS === */
+
+/* Formats selected by the extension of the -f argument. "-" is headerless
+   S16LE on stdin/stdout, replacing the separate decode_raw tool. */
+#define KCS_FORMAT_FLAC 0
+#define KCS_FORMAT_WAV 1
+#define KCS_FORMAT_RAW 2
+#define KCS_FORMAT_OGG 3
+
+#define WAV_HEADER_LENGTH 44
+
+int kcs_file_format(const char *name){
+ const char *ext = strrchr(name,'.');
+ 
+ if(strcmp(name,"-") == 0)
+  return KCS_FORMAT_RAW;
+ if(ext == NULL)
+  return KCS_FORMAT_FLAC;
+ if(strcasecmp(ext,".wav") == 0)
+  return KCS_FORMAT_WAV;
+ if(
+  strcasecmp(ext,".raw") == 0 ||
+  strcasecmp(ext,".pcm") == 0 ||
+  strcasecmp(ext,".s16") == 0
+ )
+  return KCS_FORMAT_RAW;
+ if(strcasecmp(ext,".ogg") == 0 || strcasecmp(ext,".oga") == 0)
+  return KCS_FORMAT_OGG;
+ return KCS_FORMAT_FLAC;
+}
+
+static void kcs_put_le(unsigned char *p,uint32_t value,unsigned bytes){
+ unsigned x;
+ 
+ for(x = 0;x < bytes;x++)
+  p[x] = value >> (x * 8);
+}
+
+static uint32_t kcs_get_le(const unsigned char *p,unsigned bytes){
+ uint32_t value = 0;
+ 
+ while(bytes--)
+  value = (value << 8) | p[bytes];
+ return value;
+}
+
+static void kcs_wav_header(
+ unsigned char *header,
+ unsigned channels,
+ unsigned framerate,
+ uint32_t data_bytes
+){
+ memcpy(header,"RIFF",4);
+ kcs_put_le(header + 4,data_bytes + WAV_HEADER_LENGTH - 8,4);
+ memcpy(header + 8,"WAVEfmt ",8);
+ kcs_put_le(header + 16,16,4);
+ kcs_put_le(header + 20,1,2); /* PCM */
+ kcs_put_le(header + 22,channels,2);
+ kcs_put_le(header + 24,framerate,4);
+ kcs_put_le(header + 28,framerate * channels * sizeof(int16_t),4);
+ kcs_put_le(header + 32,channels * sizeof(int16_t),2);
+ kcs_put_le(header + 34,sizeof(int16_t) * 8,2);
+ memcpy(header + 36,"data",4);
+ kcs_put_le(header + 40,data_bytes,4);
+}
+
+struct kcs_file_client {
+ FILE *op;
+ uint32_t data_bytes;
+};
+
+static int kcs_file_sink(void *sink_data,void *samples,unsigned frames){
+ struct kcs_file_client *client = sink_data;
+ const int16_t *buffer = samples;
+ unsigned char le[2];
+ unsigned x,length = frames * KCS_CHANNELS;
+ 
+ if(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__){
+  if(fwrite(buffer,sizeof(*buffer),length,client->op) != length)
+   return -1;
+ }else{
+  for(x = 0;x < length;x++){
+   kcs_put_le(le,(uint16_t)buffer[x],2);
+   if(fwrite(le,1,2,client->op) != 2)
+    return -1;
+  }
  }
+ client->data_bytes += length * sizeof(*buffer);
+ return 0;
+}
+
+int kcs_encode_file(
+ const struct kcs_encoder *enc,
+ FILE **ip,
+ char *out,
+ int format
+){
+ unsigned char header[WAV_HEADER_LENGTH];
+ struct kcs_file_client client;
+ int error = 0;
  
- buffer = kcs_encode_carrier(KCS_TRAILER,&length);
- if(pa_simple_write(s,buffer,length * sizeof(*buffer),&err) < 0)
-  goto encode_error;
- free(buffer);
+ if(strcmp(out,"-") == 0)
+  client.op = stdout;
+ else if((client.op = fopen(out,"wb")) == NULL){
+  perror(out);
+  return -1;
+ }
+ client.data_bytes = 0;
  
- if(pa_simple_drain(s,&err) < 0)
-  goto encode_error;
- pa_simple_free(s);
+ /* The WAV sizes are patched once the stream is done; if the output cannot
+    seek they are left at their maximum, which most readers accept. */
+ if(format == KCS_FORMAT_WAV){
+  kcs_wav_header(header,KCS_CHANNELS,enc->params.framerate,
+   UINT32_MAX - WAV_HEADER_LENGTH);
+  fwrite(header,1,WAV_HEADER_LENGTH,client.op);
+ }
  
- return;
- encode_error:
- fprintf(stderr,"Error: %s\n",pa_strerror(err));
- pa_simple_free(s);
- return;
-}
-
-char *kcs_decode_block(
- int16_t *data,
- unsigned data_length,
- unsigned *offset, /* Offset used for next function call */
- unsigned *length
-){
- /* Decodes a sample block and produces decoded characters as output. */
- 
- int ones_length = round((double)KCS_FRAMERATE/KCS_ONES_FREQ);
- int zero_length = round((double)KCS_FRAMERATE/KCS_ZERO_FREQ);
- int ones_tolerance = 
-  (max(ones_length,zero_length) - min(ones_length,zero_length))/4;
- int zero_tolerance = 
-  (max(ones_length,zero_length) - min(ones_length,zero_length))/4;
- int16_t sql_pulse = fmin(1.0,fmax(0.0,KCS_SQUELCH)) * INT16_MAX;
- int distance;
- int ones_distance,zero_distance;
-
- unsigned char *cyclefreq = NULL;
- unsigned cyclefreq_length = 0;
- unsigned short *cyclefreq_incs = NULL;
- char *text = NULL;
- unsigned text_length = 0;
- unsigned last_text = data_length;
- unsigned data_pos1,data_pos2,data_pos3;
- unsigned pos1,pos2,pos3,x;
- char decoded_byte;
- 
- /* === CYCLEFREQ DECODING === */
- 
- /* Find the first sample that has a higher value than sql_pulse. */
- for(pos1 = 0;(pos1 < data_length)?(data[pos1] <= sql_pulse):0;pos1++);
- 
- /* Go to the first zero cross */
- for(;(pos1 < data_length)?(data[pos1] >= 0):0;pos1++);
- 
- do{
-  
-  /* Seek to the next cycle of the (possible) wave */
-  for(pos2 = pos1 + 1;(pos2 < data_length)?(data[pos2] < 0):0;pos2++);
-  for(pos2++;(pos2 < data_length)?(data[pos2] >= 0):0;pos2++);
-  
-  /* Skip it if its amplitude is not high enough */
-  for(pos3 = pos1;pos3 < pos2 && data[pos3] < sql_pulse;pos3++);
-  if(pos3 == pos2){
-   pos1 = pos2;
-   continue;
+ if(kcs_encode_stream(enc,ip,sizeof(int16_t),kcs_file_sink,&client) < 0){
+  perror(out);
+  error = -1;
+ }
+ 
+ if(format == KCS_FORMAT_WAV && fseek(client.op,0,SEEK_SET) == 0){
+  kcs_wav_header(header,KCS_CHANNELS,enc->params.framerate,
+   client.data_bytes);
+  fwrite(header,1,WAV_HEADER_LENGTH,client.op);
+ }
+ 
+ if(client.op != stdout){
+  if(fclose(client.op) != 0)
+   error = -1;
+ }else
+  fflush(client.op);
+ return error;
+}
+
+
+/* === DECODED OUTPUT ===
+   Each channel's bytes go through a deframer of its own with -F, then to
+   a file of its own, or with one output for several channels into a
+   queue from which kcs_output_stripe() takes blocks in turn, undoing the
+   striping of kcs_encode_channels(). Channels may be written from threads
+   of their own as long as only one thread calls kcs_output_stripe(). */
+struct kcs_output_channel {
+ FILE *op; /* Unless striped */
+ struct kcs_fec_decoder fec;
+ char *held;
+ size_t held_start,held_length,held_capacity;
+};
+
+struct kcs_output {
+ FILE *op; /* The striped output, or NULL */
+ unsigned channels;
+ struct kcs_output_channel channel[KCS_CHANNELS_MAX];
+ unsigned turn; /* Channel whose block is being written */
+ size_t given; /* Bytes of that block written */
+};
+
+static void kcs_output_put(
+ struct kcs_output *out,
+ unsigned channel,
+ const char *text,
+ size_t text_length
+){
+ struct kcs_output_channel *ch = &out->channel[channel];
+ char *held;
+ 
+ if(out->op == NULL){
+  fwrite(text,sizeof(*text),text_length,ch->op);
+  return;
+ }
+ if(ch->held_start + ch->held_length + text_length > ch->held_capacity){
+  memmove(ch->held,ch->held + ch->held_start,ch->held_length);
+  ch->held_start = 0;
+ }
+ if(ch->held_length + text_length > ch->held_capacity){
+  held = realloc(ch->held,ch->held_capacity * 2 + text_length);
+  if(held == NULL){
+   fputs("Out of memory\n",stderr);
+   return;
   }
-  
-  if(pos2 < data_length){
-   
-   /* Append the appropriate value to cyclefreq. */
-   distance = pos2 - pos1;
-   ones_distance =
-    (distance - ones_length < 0)?ones_length - distance:distance - ones_length;
-   zero_distance =
-    (distance - zero_length < 0)?zero_length - distance:distance - zero_length;
-   if(
-    distance <= max(ones_length,zero_length) +
-    (ones_distance < zero_distance)?ones_tolerance:zero_tolerance &&
-    distance >= min(ones_length,zero_length) -
-    (ones_distance < zero_distance)?ones_tolerance:zero_tolerance
-   ){
-    cyclefreq = realloc(cyclefreq,++cyclefreq_length * sizeof(*cyclefreq));
-    cyclefreq_incs =
-     realloc(cyclefreq_incs,cyclefreq_length * sizeof(*cyclefreq_incs));
-    cyclefreq_incs[cyclefreq_length - 1] = pos2 - pos1;
-    if(ones_distance < zero_distance)
-     cyclefreq[cyclefreq_length - 1] = 1;
-    if(zero_distance < ones_distance)
-     cyclefreq[cyclefreq_length - 1] = 0;
-   }
+  ch->held = held;
+  ch->held_capacity = ch->held_capacity * 2 + text_length;
+ }
+ memcpy(ch->held + ch->held_start + ch->held_length,text,text_length);
+ ch->held_length += text_length;
+}
+
+static void kcs_output_stripe(struct kcs_output *out,int final){
+ /* Writes the held blocks that are next in turn. At the end of the
+    stream a channel that falls short of its block gives up its turn,
+    until a whole round has nothing left. */
+ unsigned block = KCS_FRAMED?KCS_FEC_PAYLOAD:ENC_BLOCKSIZE;
+ struct kcs_output_channel *ch;
+ unsigned idle = 0;
+ size_t length;
+ 
+ if(out->op == NULL)
+  return;
+ while(idle < out->channels){
+  ch = &out->channel[out->turn];
+  length = block - out->given;
+  if(length > ch->held_length)
+   length = ch->held_length;
+  fwrite(ch->held + ch->held_start,sizeof(*ch->held),length,out->op);
+  ch->held_start += length;
+  ch->held_length -= length;
+  if(ch->held_length == 0)
+   ch->held_start = 0;
+  out->given += length;
+  if(out->given < block && !final)
+   break;
+  idle = length?0:idle + 1;
+  out->turn = (out->turn + 1) % out->channels;
+  out->given = 0;
+ }
+}
+
+static void kcs_write_text(
+ struct kcs_output *out,
+ unsigned channel,
+ const char *text,
+ size_t text_length
+){
+ /* Writes decoded bytes, or with -F the payload of the frames they
+    complete */
+ char payload[KCS_FEC_FRAME + KCS_FEC_PAYLOAD];
+ unsigned length;
+ 
+ if(!KCS_FRAMED){
+  kcs_output_put(out,channel,text,text_length);
+  return;
+ }
+ while(text_length){
+  length = (text_length < KCS_FEC_FRAME)?text_length:KCS_FEC_FRAME;
+  kcs_output_put(out,channel,payload,kcs_fec_deframe(
+   &out->channel[channel].fec,text,length,payload));
+  text += length;
+  text_length -= length;
+ }
+}
+
+static void kcs_output_flush(struct kcs_output *out){
+ unsigned x;
+ 
+ if(out->op != NULL)
+  fflush(out->op);
+ for(x = 0;out->op == NULL && x < out->channels;x++)
+  fflush(out->channel[x].op);
+}
+
+static int kcs_output_open(struct kcs_output *out,char **names,unsigned count){
+ /* Opens a file for each channel, or one or stdout for all of them */
+ unsigned x;
+ FILE *op;
+ 
+ memset(out,0,sizeof(*out));
+ out->channels = KCS_CHANNELS;
+ for(x = 0;x < out->channels;x++)
+  kcs_fec_decoder_init(&out->channel[x].fec);
+ for(x = 0;count > 1 && x < count;x++)
+  if((out->channel[x].op = fopen(names[x],"wb")) == NULL){
+   perror(names[x]);
+   while(x--)
+    fclose(out->channel[x].op);
+   return -1;
   }
-  pos1 = pos2;
-  
- }while(pos1 < data_length);
+ if(count > 1)
+  return 0;
+ if(count == 0)
+  op = stdout;
+ else if((op = fopen(names[0],"wb")) == NULL){
+  perror(names[0]);
+  return -1;
+ }
+ if(out->channels > 1)
+  out->op = op;
+ else
+  out->channel[0].op = op;
+ return 0;
+}
+
+static void kcs_output_frames(
+ const struct kcs_output *out,
+ struct kcs_fec_decoder *sum
+){
+ /* Totals the deframers' counts over the channels */
+ unsigned x;
  
- /* ===TEXT DECODING === */
+ memset(sum,0,sizeof(*sum));
+ for(x = 0;x < out->channels;x++){
+  sum->frames += out->channel[x].fec.frames;
+  sum->corrected += out->channel[x].fec.corrected;
+  sum->failed += out->channel[x].fec.failed;
+  sum->missed += out->channel[x].fec.missed;
+ }
+}
+
+static int kcs_output_close(struct kcs_output *out){
+ unsigned x;
+ int error = 0;
  
- pos1 = data_pos1 = 0;
- do{
-  
-  /* Seek to the beginning of the start bit */
-  for(
-   ;
-   (pos1 < cyclefreq_length)?(cyclefreq[pos1] == 1):0;
-   data_pos1 += cyclefreq_incs[pos1],pos1++
-  );
-  
-  
-  
-  /* Verify the start bit */
-  for(
-   data_pos2 = data_pos1,pos2 = pos1;
-   (pos2 < cyclefreq_length)?
-   (pos1 + KCS_ZERO_CYCLES > pos2 && cyclefreq[pos2] == 0):0;
-   data_pos2 += cyclefreq_incs[pos2],pos2++
-  );
-  if(pos1 + KCS_ZERO_CYCLES != pos2)
-   goto skip_bad;
-  
-  /* Read the data bits */
-  for(decoded_byte = 0x0,x = 0x1;x <= 0x80;x <<= 1){
-   for(
-    data_pos3 = data_pos2,pos3 = pos2;
-    (pos3 < cyclefreq_length)?
-    (pos2 + KCS_ONES_CYCLES > pos3 && cyclefreq[pos3] == 1):0;
-    data_pos3 += cyclefreq_incs[pos3],pos3++
-   );
-   if(pos2 + KCS_ONES_CYCLES == pos3){
-    data_pos2 = data_pos3;
-    pos2 = pos3;
-    decoded_byte |= x;
-    continue;
-   }
-   for(
-    data_pos3 = data_pos2,pos3 = pos2;
-    (pos3 < cyclefreq_length)?
-    (pos2 + KCS_ZERO_CYCLES > pos3 && cyclefreq[pos3] == 0):0;
-    data_pos3 += cyclefreq_incs[pos3],pos3++
-   );
-   if(pos2 + KCS_ZERO_CYCLES == pos3){
-    data_pos2 = data_pos3;
-    pos2 = pos3;
-   }
+ for(x = 0;x < out->channels;x++){
+  if(out->channel[x].op != NULL && fclose(out->channel[x].op) != 0)
+   error = -1;
+  free(out->channel[x].held);
+ }
+ if(out->op != NULL && fclose(out->op) != 0)
+  error = -1;
+ return error;
+}
+
+static int kcs_output_error(const struct kcs_output *out){
+ unsigned x;
+ 
+ if(out->op != NULL)
+  return ferror(out->op);
+ for(x = 0;x < out->channels;x++)
+  if(ferror(out->channel[x].op))
+   return 1;
+ return 0;
+}
+
+static void kcs_decoder_write(
+ struct kcs_decoder *dec,
+ struct kcs_output *out,
+ unsigned channel
+){
+ /* Writes out every byte the decoder has ready */
+ char text[1024];
+ size_t text_length;
+ 
+ while((text_length = kcs_decoder_pull(dec,text,sizeof(text))) > 0)
+  kcs_write_text(out,channel,text,text_length);
+}
+
+static int kcs_decoder_open(
+ struct kcs_decoder *dec,
+ const struct kcs_params *params
+){
+ /* kcs_decoder_init(), saying so if it fails, as for a file's own rate */
+ if(kcs_decoder_init(dec,params) == 0)
+  return 0;
+ fprintf(stderr,"Error: cannot decode at %u Hz\n",params->framerate);
+ return -1;
+}
+
+static int kcs_channels_init(
+ struct kcs_decoder *dec,
+ const struct kcs_params *params,
+ unsigned channels
+){
+ unsigned x;
+ 
+ for(x = 0;x < channels;x++)
+  if(kcs_decoder_open(&dec[x],params) < 0){
+   while(x--)
+    kcs_decoder_free(&dec[x]);
+   return -1;
   }
-   
-  /* Verify stop bits */
-  for(
-   data_pos3 = data_pos2,pos3 = pos2;
-   (pos3 < cyclefreq_length)?
-   (pos2 + KCS_ONES_CYCLES * 2 > pos3 && cyclefreq[pos3] == 1):0;
-   data_pos3 += cyclefreq_incs[pos3],pos3++
-  );
-  if(pos2 + KCS_ONES_CYCLES * 2 != pos3)
-   goto skip_bad;
-  
-  /* Append the value to text */
-  text = realloc(text,++text_length * sizeof(*text));
-  text[text_length - 1] = decoded_byte;
-  
-  data_pos1 = data_pos3;
-  last_text = data_pos1;
-  pos1 = pos3;
-  
-  continue;
-  skip_bad:
-  for(
-   data_pos2 = data_pos1,pos2 = pos1;
-   (pos1 < cyclefreq_length)?
-   (cyclefreq[pos1] == 0 && pos2 - pos1 < KCS_ZERO_CYCLES):0;
-   data_pos2 += cyclefreq_incs[pos2],pos2++
-  );
-  data_pos1 = data_pos2;
-  pos1 = pos2;
-  
- }while(pos1 < cyclefreq_length);
+ return 0;
+}
+
+static void kcs_channels_free(struct kcs_decoder *dec,unsigned channels){
+ unsigned x;
+ 
+ for(x = 0;x < channels;x++){
+  kcs_decoder_tally(&dec[x]);
+  kcs_decoder_free(&dec[x]);
+ }
+}
+
+static int kcs_channels_feed(
+ struct kcs_decoder *dec,
+ struct kcs_output *out,
+ const int16_t *data,
+ size_t frames,
+ unsigned stride /* Samples a frame in data, at least out->channels */
+){
+ /* Hands each channel's decoder its samples from interleaved frames */
+ int16_t split[KCS_CHANNEL_CHUNK];
+ size_t pos,length,x;
+ unsigned y;
+ 
+ for(y = 0;y < out->channels;y++){
+  for(pos = 0;stride > 1 && pos < frames;pos += length){
+   length = (frames - pos < KCS_CHANNEL_CHUNK)?frames - pos:
+    KCS_CHANNEL_CHUNK;
+   for(x = 0;x < length;x++)
+    split[x] = data[(pos + x) * stride + y];
+   if(kcs_decoder_feed(&dec[y],split,length) < 0)
+    return -1;
+  }
+  if(stride == 1 && kcs_decoder_feed(&dec[y],data,frames) < 0)
+   return -1;
+  kcs_decoder_write(&dec[y],out,y);
+ }
+ kcs_output_stripe(out,0);
+ return 0;
+}
+
+static int kcs_channels_finish(struct kcs_decoder *dec,struct kcs_output *out){
+ unsigned x;
+ int error = 0;
  
+ for(x = 0;x < out->channels;x++){
+  if(kcs_decoder_finish(&dec[x]) < 0)
+   error = -1;
+  kcs_decoder_write(&dec[x],out,x);
+ }
+ kcs_output_stripe(out,1);
+ return error;
+}
+
+struct kcs_flac_client {
+ struct kcs_output *out;
+ struct kcs_params params; /* With the file's frame rate */
+ struct kcs_decoder dec[KCS_CHANNELS_MAX];
+ int started; /* The decoders are set up at the first frame */
+};
+
+static FLAC__StreamDecoderWriteStatus kcs_flac_write(
+ const FLAC__StreamDecoder *decoder,
+ const FLAC__Frame *frame,
+ const FLAC__int32 *const buffer[],
+ void *client_data
+){
+ struct kcs_flac_client *client = client_data;
+ const FLAC__int32 *pcm;
+ int16_t data[1024];
+ unsigned shift,x,y,pos,copy_length;
  
- free(cyclefreq);
- free(cyclefreq_incs);
- *offset = last_text;
+ (void)decoder;
  
- if(text_length == 0){
-  text = malloc(1);
-  *length = 0;
-  return text;
+ /* Channels past those asked for are left out; samples are scaled to
+    16 bits */
+ if(frame->header.channels < client->out->channels){
+  fprintf(stderr,"Error: the file has %u channels\n",frame->header.channels);
+  return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+ }
+ if(!client->started){
+  client->params.framerate = frame->header.sample_rate;
+  if(kcs_channels_init(client->dec,&client->params,client->out->channels) < 0)
+   return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+  client->started = 1;
+ }
+ shift = frame->header.bits_per_sample;
+ for(y = 0;y < client->out->channels;y++){
+  pcm = buffer[y];
+  for(pos = 0;pos < frame->header.blocksize;pos += copy_length){
+   copy_length = min(frame->header.blocksize - pos,1024);
+   if(shift > 16){
+    for(x = 0;x < copy_length;x++)
+     data[x] = pcm[pos + x] >> (shift - 16);
+   }else{
+    for(x = 0;x < copy_length;x++)
+     data[x] = pcm[pos + x] << (16 - shift);
+   }
+   if(kcs_decoder_feed(&client->dec[y],data,copy_length) < 0)
+    return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+  }
+  kcs_decoder_write(&client->dec[y],client->out,y);
  }
+ kcs_output_stripe(client->out,0);
  
- *length = text_length;
- return text;
+ return kcs_output_error(client->out)?
+  FLAC__STREAM_DECODER_WRITE_STATUS_ABORT:
+  FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void kcs_flac_error(
+ const FLAC__StreamDecoder *decoder,
+ FLAC__StreamDecoderErrorStatus status,
+ void *client_data
+){
+ (void)decoder;
+ (void)client_data;
+ fprintf(stderr,"Error: %s\n",FLAC__StreamDecoderErrorStatusString[status]);
 }
 
-void kcs_decode_flac(FILE *op,char *in){
+int kcs_decode_flac(
+ const struct kcs_params *params,
+ struct kcs_output *out,
+ char *in
+){
  FLAC__StreamDecoder *decoder;
+ FLAC__StreamDecoderInitStatus status;
+ struct kcs_flac_client client;
+ int error = -1;
+ 
+ /* The frame rate is the file's, so the decoders wait for its first frame */
+ client.out = out;
+ client.params = *params;
+ client.started = 0;
  
  decoder = FLAC__stream_decoder_new();
- fputs("Not yet implemented!",stderr);
+ status = FLAC__stream_decoder_init_file(
+  decoder,
+  in,
+  kcs_flac_write,
+  NULL,
+  kcs_flac_error,
+  &client
+ );
+ if(status != FLAC__STREAM_DECODER_INIT_STATUS_OK){
+  fprintf(stderr,"Error: %s\n",FLAC__StreamDecoderInitStatusString[status]);
+  goto decode_end;
+ }
+ 
+ if(!FLAC__stream_decoder_process_until_end_of_stream(decoder))
+  fprintf(stderr,"Error: %s\n",
+   FLAC__StreamDecoderStateString[FLAC__stream_decoder_get_state(decoder)]);
+ else
+  error = 0;
+ 
+ if(client.started && kcs_channels_finish(client.dec,out) < 0)
+  error = -1;
  
+ FLAC__stream_decoder_finish(decoder);
+ decode_end:
  FLAC__stream_decoder_delete(decoder);
+ if(client.started)
+  kcs_channels_free(client.dec,out->channels);
+ return error;
 }
 
-void kcs_decode_pa(FILE *op){
- int16_t *data;
- unsigned dec_blocksize = 
-  264 * fmax(
-   KCS_FRAMERATE * KCS_ONES_CYCLES / KCS_ONES_FREQ,
-   KCS_FRAMERATE * KCS_ZERO_CYCLES / KCS_ZERO_FREQ
-  );
+int kcs_decode_ogg(
+ const struct kcs_params *params,
+ struct kcs_output *out,
+ char *in
+){
+ struct kcs_params file_params = *params;
+ struct kcs_decoder dec[KCS_CHANNELS_MAX];
+ OggVorbis_File vf;
+ vorbis_info *vi;
+ int16_t data[4096];
+ long length;
+ unsigned channels,frames;
+ int section;
+ int error = -1;
+ 
+ if(ov_fopen(in,&vf) < 0){
+  fprintf(stderr,"Error: %s is not an Ogg Vorbis file\n",in);
+  return -1;
+ }
+ vi = ov_info(&vf,-1);
+ file_params.framerate = vi->rate;
+ channels = vi->channels;
+ if(channels < out->channels){
+  fprintf(stderr,"Error: %s has %u channels\n",in,channels);
+  goto decode_end;
+ }
+ if(kcs_channels_init(dec,&file_params,out->channels) < 0)
+  goto decode_end;
+ 
+ /* ov_read() hands back whole interleaved frames of 16-bit samples */
+ while((length = ov_read(&vf,(char *)data,sizeof(data),
+  __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__,sizeof(*data),1,&section)) != 0){
+  if(length == OV_HOLE)
+   continue;
+  if(length < 0){
+   fprintf(stderr,"Error: %s is damaged\n",in);
+   break;
+  }
+  frames = length / sizeof(*data) / channels;
+  if(kcs_channels_feed(dec,out,data,frames,channels) < 0)
+   break;
+ }
+ if(length == 0)
+  error = 0;
+ if(kcs_channels_finish(dec,out) < 0)
+  error = -1;
+ 
+ kcs_channels_free(dec,out->channels);
+ decode_end:
+ ov_clear(&vf);
+ return error;
+}
+
+/* A slice of an in-memory recording decoded on its own thread. The
+   decoder runs over [start,end), which overlaps the neighbouring slices,
+   and records where each byte's start bit lies so the slices can be
+   joined on a byte both neighbours agree on. */
+struct kcs_decode_job {
+ struct kcs_decoder dec;
+ const int16_t *data;
+ size_t start,end;
+ size_t keep_start;
+ char *text;
+ size_t *text_pos;
+ size_t text_first,text_length,text_capacity;
+ int error;
+};
+
+static void *kcs_decode_job_run(void *arg){
+ struct kcs_decode_job *job = arg;
  char *text;
- unsigned offset = dec_blocksize,text_length = 0;
+ size_t *text_pos;
+ unsigned window = job->dec.window_capacity;
+ unsigned block_length,text_length,x;
+ size_t pos;
+ 
+ for(pos = job->start;;pos += block_length){
+  block_length = (job->end - pos < window)?job->end - pos:window;
+  if(block_length)
+   text = kcs_decode_block(&job->dec,job->data + pos,block_length,
+    &text_length);
+  else
+   text = kcs_decode_end(&job->dec,&text_length);
+  if(text == NULL){
+   job->error = 1;
+   return NULL;
+  }
+  if(job->text_length + text_length > job->text_capacity){
+   job->text_capacity = job->text_capacity * 2 + text_length;
+   text = realloc(job->text,job->text_capacity * sizeof(*text));
+   if(text != NULL)
+    job->text = text;
+   text_pos = realloc(job->text_pos,job->text_capacity * sizeof(*text_pos));
+   if(text_pos != NULL)
+    job->text_pos = text_pos;
+   if(text == NULL || text_pos == NULL){
+    job->error = 1;
+    return NULL;
+   }
+   text = job->dec.text;
+  }
+  for(x = 0;x < text_length;x++){
+   job->text[job->text_length] = text[x];
+   job->text_pos[job->text_length++] = job->start + job->dec.text_pos[x];
+  }
+  
+  if(block_length == 0)
+   break;
+ }
+ return NULL;
+}
+
+static size_t kcs_decode_splice(
+ const struct kcs_decode_job *prev,
+ const struct kcs_decode_job *next,
+ size_t *next_first
+){
+ /* Finds the first byte at or after next's slice start that both jobs
+    decoded, returning where prev's bytes stop and setting where next's
+    bytes take over. Start bits are matched within half a bit, as the
+    demodulators may place them slightly differently; text_pos counts
+    samples fed, so the half bit is at the rate fed, not the internal
+    rate the parameters hold. */
+ const struct kcs_params *params = &prev->dec.params;
+ size_t x = 0,y = 0;
+ size_t slack = (size_t)prev->dec.rate * params->zero_cycles /
+  params->zero_freq / 2;
+ 
+ while(x < prev->text_length && prev->text_pos[x] < next->keep_start)
+  x++;
+ while(y < next->text_length && next->text_pos[y] < next->keep_start)
+  y++;
+ *next_first = y;
+ for(;x < prev->text_length && y < next->text_length;){
+  if(prev->text_pos[x] + slack < next->text_pos[y])
+   x++;
+  else if(next->text_pos[y] + slack < prev->text_pos[x])
+   y++;
+  else{
+   *next_first = y;
+   return x;
+  }
+ }
+ /* Never resynchronised; cut at the slice boundary */
+ for(x = 0;x < prev->text_length && prev->text_pos[x] < next->keep_start;)
+  x++;
+ return x;
+}
+
+static int kcs_decode_parallel(
+ const struct kcs_params *params,
+ struct kcs_output *out,
+ unsigned channel,
+ const int16_t *data,
+ size_t data_length,
+ unsigned threads
+){
+ struct kcs_decode_job *jobs;
+ pthread_t *tids;
+ /* Room for a null pulse plus a decode window of bytes to resync in */
+ size_t overlap = kcs_decode_window(params) +
+  (size_t)params->null_cycles * params->framerate / params->ones_freq;
+ size_t slice = (data_length + threads - 1) / threads;
+ size_t last;
+ unsigned x,started;
+ int error = -1;
+ 
+ jobs = calloc(threads,sizeof(*jobs));
+ tids = calloc(threads,sizeof(*tids));
+ if(jobs == NULL || tids == NULL)
+  goto parallel_end;
+ 
+ for(x = 0;x < threads;x++){
+  jobs[x].data = data;
+  jobs[x].keep_start = slice * x;
+  jobs[x].start = (jobs[x].keep_start > overlap)?
+   jobs[x].keep_start - overlap:0;
+  jobs[x].end = min(slice * (x + 1) + overlap,data_length);
+  if(kcs_decoder_open(&jobs[x].dec,params) < 0)
+   goto parallel_end;
+ }
+ 
+ for(started = 1;started < threads;started++)
+  if(pthread_create(&tids[started],NULL,kcs_decode_job_run,&jobs[started]))
+   break;
+ kcs_decode_job_run(&jobs[0]);
+ for(x = started;x < threads;x++)
+  kcs_decode_job_run(&jobs[x]);
+ for(x = 1;x < started;x++)
+  pthread_join(tids[x],NULL);
+ 
+ for(x = 0;x < threads;x++)
+  if(jobs[x].error){
+   fputs("Out of memory\n",stderr);
+   goto parallel_end;
+  }
+ 
+ for(x = 0;x < threads;x++){
+  if(x + 1 < threads)
+   last = kcs_decode_splice(&jobs[x],&jobs[x + 1],&jobs[x + 1].text_first);
+  else
+   last = jobs[x].text_length;
+  if(last > jobs[x].text_first)
+   kcs_write_text(out,channel,jobs[x].text + jobs[x].text_first,
+    last - jobs[x].text_first);
+ }
+ error = 0;
+ 
+ parallel_end:
+ for(x = 0;jobs != NULL && x < threads;x++){
+  kcs_decoder_tally(&jobs[x].dec);
+  kcs_decoder_free(&jobs[x].dec);
+  free(jobs[x].text);
+  free(jobs[x].text_pos);
+ }
+ free(jobs);
+ free(tids);
+ return error;
+}
+
+int kcs_decode_samples(
+ const struct kcs_params *params,
+ struct kcs_output *out,
+ unsigned channel,
+ const int16_t *data,
+ size_t data_length
+){
+ /* Decodes samples that are already in memory, without copying them */
+ struct kcs_decoder dec;
+ char *text;
+ unsigned window = kcs_decode_window(params);
+ unsigned block_length,text_length;
+ size_t pos;
+ int error = 0;
+ 
+ /* Slices much shorter than a decode window are not worth a thread */
+ if(KCS_THREADS > 1 && data_length / KCS_THREADS > (size_t)window * 16)
+  return kcs_decode_parallel(params,out,channel,data,data_length,
+   KCS_THREADS);
+ 
+ if(kcs_decoder_open(&dec,params) < 0)
+  return -1;
+ 
+ for(pos = 0;;pos += block_length){
+  block_length = (data_length - pos < window)?data_length - pos:window;
+  if(block_length)
+   text = kcs_decode_block(&dec,data + pos,block_length,&text_length);
+  else
+   text = kcs_decode_end(&dec,&text_length);
+  if(text == NULL){
+   error = -1;
+   break;
+  }
+  kcs_write_text(out,channel,text,text_length);
+  
+  if(block_length == 0)
+   break;
+ }
+ 
+ kcs_decoder_tally(&dec);
+ kcs_decoder_free(&dec);
+ return error;
+}
+
+int kcs_decode_stream(
+ const struct kcs_params *params,
+ struct kcs_output *out,
+ FILE *ip
+){
+ /* Decodes headerless S16LE frames from a pipe */
+ struct kcs_decoder dec[KCS_CHANNELS_MAX];
+ int16_t data[4096];
+ size_t frames;
+ int error = 0;
+ 
+ if(kcs_channels_init(dec,params,out->channels) < 0)
+  return -1;
+ 
+ while((frames = fread(data,sizeof(*data) * out->channels,
+  4096 / out->channels,ip)) > 0)
+  if(kcs_channels_feed(dec,out,data,frames,out->channels) < 0){
+   error = -1;
+   break;
+  }
+ if(kcs_channels_finish(dec,out) < 0)
+  error = -1;
+ 
+ kcs_channels_free(dec,out->channels);
+ return error;
+}
+
+/* A channel of an in-memory recording, split out of the interleaved
+   frames and decoded on a thread of its own */
+struct kcs_channel_job {
+ const struct kcs_params *params;
+ struct kcs_output *out;
+ unsigned channel;
+ int16_t *data;
+ size_t data_length;
+ int error;
+};
+
+static void *kcs_channel_job_run(void *arg){
+ struct kcs_channel_job *job = arg;
+ 
+ job->error = kcs_decode_samples(job->params,job->out,job->channel,
+  job->data,job->data_length);
+ return NULL;
+}
+
+static int kcs_decode_channels(
+ const struct kcs_params *params,
+ struct kcs_output *out,
+ const int16_t *data,
+ size_t frames,
+ unsigned stride
+){
+ struct kcs_channel_job jobs[KCS_CHANNELS_MAX];
+ pthread_t tids[KCS_CHANNELS_MAX];
+ size_t x;
+ unsigned y,started = 0;
+ int error = -1;
+ 
+ for(y = 0;y < out->channels;y++){
+  jobs[y].params = params;
+  jobs[y].out = out;
+  jobs[y].channel = y;
+  jobs[y].data_length = frames;
+  if((jobs[y].data = malloc((frames?frames:1) * sizeof(*data))) == NULL){
+   fputs("Out of memory\n",stderr);
+   goto channels_end;
+  }
+  for(x = 0;x < frames;x++)
+   jobs[y].data[x] = data[x * stride + y];
+ }
+ 
+ /* The first channel runs on this thread, and any the others could not
+    be started for after it */
+ for(started = 1;started < out->channels;started++)
+  if(pthread_create(&tids[started],NULL,kcs_channel_job_run,&jobs[started]))
+   break;
+ kcs_channel_job_run(&jobs[0]);
+ for(y = started;y < out->channels;y++)
+  kcs_channel_job_run(&jobs[y]);
+ for(y = 1;y < started;y++)
+  pthread_join(tids[y],NULL);
+ kcs_output_stripe(out,1);
+ for(error = 0,y = 0;y < out->channels;y++)
+  error |= jobs[y].error;
+ 
+ channels_end:
+ while(y--)
+  free(jobs[y].data);
+ return error;
+}
+
+static const unsigned char *kcs_wav_data(
+ const unsigned char *file,
+ size_t file_length,
+ size_t *data_length,
+ unsigned *framerate,
+ unsigned *channels
+){
+ /* Returns the PCM payload of a 16-bit WAV file */
+ size_t pos = 12;
+ uint32_t chunk_length;
+ int fmt_ok = 0;
+ 
+ if(
+  file_length < 12 ||
+  memcmp(file,"RIFF",4) != 0 ||
+  memcmp(file + 8,"WAVE",4) != 0
+ ){
+  fputs("Error: not a WAV file\n",stderr);
+  return NULL;
+ }
+ 
+ while(pos + 8 <= file_length){
+  chunk_length = kcs_get_le(file + pos + 4,4);
+  if(memcmp(file + pos,"fmt ",4) == 0 && chunk_length >= 16){
+   if(
+    kcs_get_le(file + pos + 8,2) != 1 ||
+    kcs_get_le(file + pos + 10,2) == 0 ||
+    kcs_get_le(file + pos + 22,2) != 16
+   ){
+    fputs("Error: only 16-bit PCM WAV files are supported\n",stderr);
+    return NULL;
+   }
+   *channels = kcs_get_le(file + pos + 10,2);
+   *framerate = kcs_get_le(file + pos + 12,4);
+   fmt_ok = 1;
+  }else if(memcmp(file + pos,"data",4) == 0 && fmt_ok){
+   pos += 8;
+   /* Streamed WAV files may leave the size at its maximum */
+   *data_length = (chunk_length > file_length - pos)?
+    file_length - pos:chunk_length;
+   return file + pos;
+  }
+  pos += 8 + chunk_length + (chunk_length & 1);
+ }
+ 
+ fputs("Error: WAV file has no audio data\n",stderr);
+ return NULL;
+}
+
+int kcs_decode_file(
+ const struct kcs_params *params,
+ struct kcs_output *out,
+ char *in,
+ int format
+){
+ struct kcs_params file_params = *params;
+ int fd;
+ struct stat st;
+ const unsigned char *file;
+ const unsigned char *data;
+ size_t data_length;
+ unsigned channels = out->channels;
+ int error = -1;
+ 
+ if(strcmp(in,"-") == 0){
+  if(kcs_decode_stream(params,out,stdin) < 0)
+   return -1;
+  return ferror(stdin)?-1:0;
+ }
+ 
+ if((fd = open(in,O_RDONLY)) < 0 || fstat(fd,&st) < 0){
+  perror(in);
+  if(fd >= 0)
+   close(fd);
+  return -1;
+ }
+ if(st.st_size == 0){
+  close(fd);
+  return 0;
+ }
+ 
+ /* Map the file so the samples are decoded in place */
+ file = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+ close(fd);
+ if(file == MAP_FAILED){
+  perror(in);
+  return -1;
+ }
+ madvise((void *)file,st.st_size,MADV_SEQUENTIAL);
+ 
+ if(format == KCS_FORMAT_WAV){
+  data = kcs_wav_data(file,st.st_size,&data_length,&file_params.framerate,
+   &channels);
+  if(data != NULL && channels < out->channels){
+   fprintf(stderr,"Error: %s has %u channels\n",in,channels);
+   data = NULL;
+  }
+ }else{
+  data = file;
+  data_length = st.st_size;
+ }
+ 
+ if(data != NULL){
+  if(__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__ || ((uintptr_t)data & 1)){
+   fputs("Error: unaligned or big-endian sample data\n",stderr);
+   data = NULL;
+  }else if(channels == 1)
+   error = kcs_decode_samples(&file_params,out,0,
+    (const int16_t *)data,data_length / sizeof(int16_t));
+  else
+   error = kcs_decode_channels(&file_params,out,(const int16_t *)data,
+    data_length / sizeof(int16_t) / channels,channels);
+ }
+ 
+ munmap((void *)file,st.st_size);
+ return error;
+}
+
+static void kcs_stats_report(
+ int decoding,
+ const struct kcs_fec_decoder *fec /* Frame totals, or NULL */
+){
+ /* Reports the totals so far on stderr, in the form -v or --stats asked
+    for; with JSON one object a line */
+ const struct kcs_totals *t = &kcs_totals;
+ double seconds = kcs_seconds() - kcs_started;
+ uint64_t starts = t->dec.bytes + t->dec.resyncs;
+ 
+ if(KCS_REPORT == KCS_REPORT_JSON && decoding){
+  fprintf(stderr,"{\"mode\":\"decode\",\"seconds\":%.3f,"
+   "\"samples\":%" PRIu64 ",\"crosses\":%" PRIu64 ",\"quiet\":%" PRIu64
+   ",\"odd\":%" PRIu64 ",\"cycles\":%" PRIu64 ",\"bytes\":%" PRIu64
+   ",\"resyncs\":%" PRIu64 ",\"ns\":{\"decimate\":%" PRIu64
+   ",\"condition\":%" PRIu64 ",\"demodulate\":%" PRIu64 ",\"frame\":%"
+   PRIu64 "}",seconds,t->dec.samples,t->dec.crosses,t->dec.quiet,
+   t->dec.odd,t->dec.cycles,t->dec.bytes,t->dec.resyncs,
+   t->dec.ns[KCS_STAGE_DECIMATE],t->dec.ns[KCS_STAGE_CONDITION],
+   t->dec.ns[KCS_STAGE_DEMODULATE],t->dec.ns[KCS_STAGE_FRAME]);
+  if(fec != NULL)
+   fprintf(stderr,",\"frames\":{\"passed\":%lu,\"repaired\":%lu,"
+    "\"failed\":%lu,\"missing\":%lu}",fec->frames,fec->corrected,
+    fec->failed,fec->missed);
+  fputs("}\n",stderr);
+ }else if(KCS_REPORT == KCS_REPORT_JSON){
+  fprintf(stderr,"{\"mode\":\"encode\",\"seconds\":%.3f,"
+   "\"bytes\":%" PRIu64 ",\"samples\":%" PRIu64 ",\"writes\":%" PRIu64
+   ",\"written\":%" PRIu64 ",\"ns\":{\"synthesis\":%" PRIu64
+   ",\"sink\":%" PRIu64 "}}\n",seconds,t->encoded,t->synthesized,
+   t->writes,t->written,t->synthesis_ns,t->sink_ns);
+ }else if(decoding){
+  fprintf(stderr,"Stats: %" PRIu64 " samples decoded in %.3f s\n"
+   " Demodulator: %" PRIu64 " crosses or hops, %" PRIu64 " under squelch, %"
+   PRIu64 " odd, %" PRIu64 " cycles\n"
+   " Framer: %" PRIu64 " bytes, %" PRIu64 " resyncs (%.2f%% of start bits)\n"
+   " Time: %.1f ms decimating, %.1f ms conditioning, %.1f ms demodulating, "
+   "%.1f ms framing\n",
+   t->dec.samples,seconds,t->dec.crosses,t->dec.quiet,t->dec.odd,
+   t->dec.cycles,t->dec.bytes,t->dec.resyncs,
+   starts?100.0 * t->dec.resyncs / starts:0.0,
+   t->dec.ns[KCS_STAGE_DECIMATE] / 1e6,t->dec.ns[KCS_STAGE_CONDITION] / 1e6,
+   t->dec.ns[KCS_STAGE_DEMODULATE] / 1e6,t->dec.ns[KCS_STAGE_FRAME] / 1e6);
+  if(fec != NULL)
+   fprintf(stderr," Frames: %lu passed, %lu bytes repaired, %lu beyond "
+    "repair, %lu missing\n",fec->frames,fec->corrected,fec->failed,
+    fec->missed);
+ }else
+  fprintf(stderr,"Stats: %" PRIu64 " bytes encoded into %" PRIu64 " samples "
+   "in %.3f s\n"
+   " Time: %.1f ms synthesising, %.1f ms in %" PRIu64 " sink writes of %"
+   PRIu64 " frames\n",t->encoded,t->synthesized,seconds,
+   t->synthesis_ns / 1e6,t->sink_ns / 1e6,t->writes,t->written);
+}
+
+/* Live decoding hands each fragment read from the sound card straight to
+   the decoder, which carries any byte the fragment splits over to the
+   next one, so a byte comes out one fragment after its stop bit at the
+   most and every sample is demodulated once. */
+
+static volatile sig_atomic_t kcs_stop = 0;
+
+static void kcs_stop_handler(int sig){
+ (void)sig;
+ kcs_stop = 1;
+}
+
+int kcs_decode_pa(const struct kcs_params *params,struct kcs_output *out){
+ struct kcs_decoder dec[KCS_CHANNELS_MAX];
+ struct sigaction action;
  static pa_sample_spec ss;
+ pa_buffer_attr attr;
  pa_simple *s = NULL;
- int err;
+ int16_t *fragment = NULL,*split = NULL;
+ char *text;
+ unsigned fragment_length,text_length,x,y,ones;
+ /* Bit lengths in samples, for where each byte ends */
+ double ones_bit = (double)params->framerate * params->ones_cycles /
+  params->ones_freq;
+ double zero_bit = (double)params->framerate * params->zero_cycles /
+  params->zero_freq;
+ /* Frames read so far, and when to report on them */
+ size_t end = 0,report = (size_t)KCS_STATS_PERIOD * params->framerate;
+ struct kcs_fec_decoder fec;
+ double latency,latency_sum = 0,latency_max = 0,card = 0;
+ unsigned long latency_count = 0;
+ int err = 0,error = -1;
  
  ss.format = PA_SAMPLE_S16LE;
- ss.rate = KCS_FRAMERATE;
- ss.channels = 1;
+ ss.rate = params->framerate;
+ ss.channels = out->channels;
+ attr = kcs_pa_attr(&ss);
+ fragment_length = max(1,attr.fragsize / sizeof(*fragment) / out->channels);
+ 
+ if(kcs_channels_init(dec,params,out->channels) < 0)
+  return -1;
+ fragment = malloc(fragment_length * out->channels * sizeof(*fragment));
+ split = malloc(fragment_length * sizeof(*split));
+ if(fragment == NULL || split == NULL)
+  goto decode_end;
  
- data = malloc(dec_blocksize * sizeof(*data));
- if(op == stdout)
-  setvbuf(op,NULL,_IONBF,0);
+ memset(&action,0,sizeof(action));
+ action.sa_handler = kcs_stop_handler;
+ sigemptyset(&action.sa_mask);
+ sigaction(SIGINT,&action,NULL);
+ sigaction(SIGTERM,&action,NULL);
  
  if(!(s = pa_simple_new(
   NULL,
@@ -500,29 +1837,296 @@ void kcs_decode_pa(FILE *op){
   "Decoding",
   &ss,
   NULL,
-  NULL,
+  &attr,
   &err
  )))
   goto decode_error;
  
- for(;;){
-  if(pa_simple_read(s,
-   data + dec_blocksize - offset,offset * sizeof(*data),&err) < 0)
+ while(!kcs_stop){
+  if(pa_simple_read(s,fragment,
+   (size_t)fragment_length * out->channels * sizeof(*fragment),&err) < 0){
+   if(kcs_stop)
+    break;
    goto decode_error;
-  text = kcs_decode_block(data,dec_blocksize,&offset,&text_length);
-  fwrite(text,sizeof(*text),text_length,stdout);
-  free(text);
-  
-  memmove(data,data + offset,(dec_blocksize - offset) * sizeof(*data));
+  }
+  end += fragment_length;
+ 
+  for(y = 0;y < out->channels;y++){
+   for(x = 0;x < fragment_length;x++)
+    split[x] = fragment[x * out->channels + y];
+   text = kcs_decode_block(&dec[y],split,fragment_length,&text_length);
+   if(text == NULL)
+    goto decode_error;
+   if(text_length == 0)
+    continue;
+   kcs_write_text(out,y,text,text_length);
+   /* From each byte's last stop bit reaching the card to it coming out */
+   card = pa_simple_get_latency(s,&err) / 1000.0;
+   for(x = 0;x < text_length;x++){
+    ones = 2 + __builtin_popcount((unsigned char)text[x]);
+    latency = card + (end - dec[y].text_pos[x] -
+     (ones * ones_bit + (11 - ones) * zero_bit) * dec[y].clock) *
+     1000.0 / params->framerate;
+    latency_sum += latency;
+    if(latency > latency_max)
+     latency_max = latency;
+   }
+   latency_count += text_length;
+  }
+  kcs_output_stripe(out,0);
+  kcs_output_flush(out);
+ 
+  if(KCS_REPORT && end >= report){
+   for(y = 0;y < out->channels;y++)
+    kcs_decoder_tally(&dec[y]);
+   kcs_output_frames(out,&fec);
+   kcs_stats_report(1,KCS_FRAMED?&fec:NULL);
+   report += (size_t)KCS_STATS_PERIOD * params->framerate;
+  }
  }
  
- pa_simple_free(s);
+ /* Whatever the decoders still hold */
+ for(y = 0;y < out->channels;y++)
+  if((text = kcs_decode_end(&dec[y],&text_length)) != NULL)
+   kcs_write_text(out,y,text,text_length);
+ kcs_output_stripe(out,1);
+ kcs_output_flush(out);
+ if(latency_count)
+  fprintf(stderr,"Latency: %.1f ms average, %.1f ms worst, "
+   "%.1f ms of it in the sound card\n",
+   latency_sum / latency_count,latency_max,card);
+ error = 0;
+ goto decode_end;
  
- return;
  decode_error:
- fprintf(stderr,"Error: %s",pa_strerror(err));
- pa_simple_free(s);
- return;
+ fprintf(stderr,"Error: %s\n",pa_strerror(err));
+ decode_end:
+ if(s)
+  pa_simple_free(s);
+ kcs_channels_free(dec,out->channels);
+ free(fragment);
+ free(split);
+ return error;
+}
+
+/* === BATCH ===
+   -B runs many files through one process on a pool of -j workers. Each
+   job pairs a text file with a recording; encoding reads the one and
+   writes the other, decoding the other way around. The encoder and its
+   wavetable are built once and shared by every worker, and the
+   decoders are built for each file, whose header sets the sample rate. */
+struct kcs_batch_job {
+ char *text;
+ char *audio;
+ int error;
+ double seconds; /* Wall clock time the job took */
+ long long bytes; /* Size of the text file once done, or -1 */
+ struct kcs_fec_decoder fec; /* Frame totals, decoding with -F */
+};
+
+struct kcs_batch {
+ const struct kcs_encoder *enc; /* NULL when decoding */
+ const struct kcs_params *params;
+ struct kcs_batch_job *jobs;
+ size_t count,capacity;
+ size_t next; /* Next job for a worker to take */
+};
+
+static int kcs_batch_add(
+ struct kcs_batch *batch,
+ const char *text,
+ size_t text_length,
+ const char *audio,
+ const char *suffix /* Appended to audio */
+){
+ struct kcs_batch_job *jobs,*job;
+ 
+ if(batch->count == batch->capacity){
+  jobs = realloc(batch->jobs,(batch->capacity * 2 + 16) * sizeof(*jobs));
+  if(jobs == NULL)
+   return -1;
+  batch->jobs = jobs;
+  batch->capacity = batch->capacity * 2 + 16;
+ }
+ job = &batch->jobs[batch->count];
+ memset(job,0,sizeof(*job));
+ job->text = strndup(text,text_length);
+ job->audio = malloc(strlen(audio) + strlen(suffix) + 1);
+ if(job->text == NULL || job->audio == NULL){
+  free(job->text);
+  free(job->audio);
+  return -1;
+ }
+ sprintf(job->audio,"%s%s",audio,suffix);
+ batch->count++;
+ return 0;
+}
+
+static int kcs_batch_manifest(struct kcs_batch *batch,FILE *ip){
+ /* Reads jobs from a manifest, one a line: the text file, then a tab or
+    a space and the recording. Blank lines and lines starting with # are
+    left out. */
+ char *line = NULL,*split;
+ size_t line_capacity = 0,line_number = 0;
+ ssize_t length;
+ int error = 0;
+ 
+ while(!error && (length = getline(&line,&line_capacity,ip)) >= 0){
+  line_number++;
+  while(length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+   line[--length] = '\0';
+  if(length == 0 || line[0] == '#')
+   continue;
+  if((split = strchr(line,'\t')) == NULL)
+   split = strchr(line,' ');
+  if(split == NULL || split == line || split[1] == '\0'){
+   fprintf(stderr,"Manifest line %zu is not a text file and a "
+    "recording\n",line_number);
+   error = -1;
+  }else if(kcs_batch_add(batch,line,split - line,split + 1,"") < 0){
+   fputs("Out of memory\n",stderr);
+   error = -1;
+  }
+ }
+ free(line);
+ return error;
+}
+
+static int kcs_batch_encode(
+ const struct kcs_encoder *enc,
+ struct kcs_batch_job *job
+){
+ FILE *ip[KCS_CHANNELS_MAX];
+ int format = kcs_file_format(job->audio);
+ int error;
+ 
+ if(kcs_input_open(ip,&job->text,1) < 0)
+  return -1;
+ if(format == KCS_FORMAT_FLAC)
+  error = kcs_encode_flac(enc,ip,job->audio);
+ else if(format == KCS_FORMAT_OGG)
+  error = kcs_encode_ogg(enc,ip,job->audio);
+ else
+  error = kcs_encode_file(enc,ip,job->audio,format);
+ if(ferror(ip[0]))
+  error = -1;
+ fclose(ip[0]);
+ return error;
+}
+
+static int kcs_batch_decode(
+ const struct kcs_params *params,
+ struct kcs_batch_job *job
+){
+ struct kcs_output out;
+ int format = kcs_file_format(job->audio);
+ int error;
+ 
+ if(kcs_output_open(&out,&job->text,1) < 0)
+  return -1;
+ if(format == KCS_FORMAT_FLAC)
+  error = kcs_decode_flac(params,&out,job->audio);
+ else if(format == KCS_FORMAT_OGG)
+  error = kcs_decode_ogg(params,&out,job->audio);
+ else
+  error = kcs_decode_file(params,&out,job->audio,format);
+ if(kcs_output_error(&out))
+  error = -1;
+ kcs_output_frames(&out,&job->fec);
+ if(kcs_output_close(&out) < 0)
+  error = -1;
+ return error;
+}
+
+static void *kcs_batch_run(void *arg){
+ /* A worker, taking jobs until there are none left */
+ struct kcs_batch *batch = arg;
+ struct kcs_batch_job *job;
+ struct stat st;
+ double start;
+ size_t x;
+ 
+ while((x = __atomic_fetch_add(&batch->next,1,__ATOMIC_RELAXED)) <
+  batch->count){
+  job = &batch->jobs[x];
+  start = kcs_seconds();
+  if(batch->enc != NULL)
+   job->error = kcs_batch_encode(batch->enc,job);
+  else
+   job->error = kcs_batch_decode(batch->params,job);
+  job->seconds = kcs_seconds() - start;
+  job->bytes = (stat(job->text,&st) == 0)?(long long)st.st_size:-1;
+ }
+ return NULL;
+}
+
+static void kcs_batch_report(const struct kcs_batch *batch,double seconds){
+ /* One line a job, in the order given, then the totals */
+ const struct kcs_batch_job *job;
+ size_t x,failed = 0;
+ 
+ for(x = 0;x < batch->count;x++){
+  job = &batch->jobs[x];
+  failed += job->error != 0;
+  fprintf(stderr,"%s %s %s: %s, %.1f ms, %lld bytes",job->text,
+   (batch->enc != NULL)?"->":"<-",job->audio,job->error?"failed":"done",
+   job->seconds * 1000,job->bytes);
+  if(KCS_FRAMED && batch->enc == NULL)
+   fprintf(stderr,", frames %lu passed, %lu bytes repaired, %lu beyond "
+    "repair, %lu missing",job->fec.frames,job->fec.corrected,
+    job->fec.failed,job->fec.missed);
+  fputc('\n',stderr);
+ }
+ fprintf(stderr,"Batch: %zu files, %zu failed, %.3f s\n",batch->count,
+  failed,seconds);
+}
+
+static int kcs_batch_files(
+ const struct kcs_encoder *enc, /* NULL to decode */
+ const struct kcs_params *params,
+ char **names,
+ unsigned count,
+ const char *suffix
+){
+ /* Runs a job for each text file named, or from the manifest on stdin
+    if none are, and returns 1 if any of them failed */
+ struct kcs_batch batch;
+ pthread_t tids[64];
+ unsigned workers,started,x;
+ double start = kcs_seconds();
+ int error = 0;
+ 
+ memset(&batch,0,sizeof(batch));
+ batch.enc = enc;
+ batch.params = params;
+ for(x = 0;x < count && !error;x++)
+  if(kcs_batch_add(&batch,names[x],strlen(names[x]),names[x],suffix) < 0){
+   fputs("Out of memory\n",stderr);
+   error = 1;
+  }
+ if(count == 0 && kcs_batch_manifest(&batch,stdin) < 0)
+  error = 1;
+ 
+ /* Threads past one a job go to the files themselves */
+ workers = min(min(KCS_THREADS,64),max(1,batch.count));
+ KCS_THREADS = max(1,KCS_THREADS / workers);
+ for(started = 1;!error && started < workers;started++)
+  if(pthread_create(&tids[started],NULL,kcs_batch_run,&batch) != 0)
+   break;
+ if(!error){
+  kcs_batch_run(&batch);
+  for(x = 1;x < started;x++)
+   pthread_join(tids[x],NULL);
+  kcs_batch_report(&batch,kcs_seconds() - start);
+ }
+ 
+ for(x = 0;x < batch.count;x++){
+  error |= batch.jobs[x].error != 0;
+  free(batch.jobs[x].text);
+  free(batch.jobs[x].audio);
+ }
+ free(batch.jobs);
+ return error;
 }
 
 int main(int argc,char *argv[]){
@@ -530,8 +2134,12 @@ int main(int argc,char *argv[]){
  const char *USAGE_TEXT = (\
 "USAGE"\
 "  %1$s -h\n"\
-"  %1$s [in.txt] [-a 0.8] [-l 5] [-t 5] [-n] -e[f out.flac]\n"\
-"  %1$s [out.txt] [-s 0.25] -d[f in.flac]\n"\
+"  %1$s [in.txt ...] [-p 1200] [-r 44100] [-a 0.8] [-l 5] [-t 5] [-n] [-F]\n"\
+"     [-c 1] [-j 1] [-b 64] [-L 20] -e[f out.flac|out.ogg|out.wav|out.raw]\n"\
+"  %1$s [out.txt ...] [-p 1200] [-s 0.25] [-g auto] [-D zerocross] [-F]\n"\
+"     [-c 1] [-j 1] [-L 20] -d[f in.flac|in.ogg|in.wav|in.raw]\n"\
+"  %1$s -B [file.txt ...] [-j 1] [options] -e|-d[f .wav]\n"\
+"  Any of these takes -v or --stats=json for statistics.\n"\
 "SUMMARY\n"\
 "  Encodes text to KCS and vice versa. For more info, see:\n"\
 "  http://en.wikipedia.org/wiki/Kansas_City_standard\n"\
@@ -541,11 +2149,25 @@ int main(int argc,char *argv[]){
 "   Encode or decode (Default: encode)\n"\
 " -f\n"\
 "   File to use in place of the soundcard.\n"\
-"   Can be appended to -e or -d options.\n"\
+"   Can be appended to -e or -d options. The format follows the\n"\
+"   extension: .wav, .ogg/.oga (Ogg Vorbis), .raw/.pcm/.s16\n"\
+"   (headerless S16LE) or FLAC.\n"\
+"   Use - for headerless S16LE on stdout/stdin.\n"\
+" -p\n"\
+"   Baud rate preset; 300 (KCS, 8 and 4 cycles per bit), 1200 (CUTS,\n"\
+"   2 and 1 cycles per bit) or custom tones and cycles given as\n"\
+"   ONES_FREQ:ONES_CYCLES:ZERO_FREQ:ZERO_CYCLES (Default: 1200)\n"\
+" -r\n"\
+"   Sample rate in Hz, 8000 to 192000; for encoding, and for decoding\n"\
+"   raw samples or the soundcard. Other files give their own\n"\
+"   (Default: 44100)\n"\
 " -a\n"\
 "   Amplitude; for encoding (Default: 0.8)\n"\
 " -s\n"\
-"   Squelch; for decoding (Default: 0.25)\n"\
+"   Squelch; for decoding, as a fraction of the signal level, or of\n"\
+"   full scale with -g off (Default: 0.25)\n"\
+" -g\n"\
+"   Gain control; auto (DC removal and AGC) or off (Default: auto)\n"\
 " -l\n"\
 "   Length of leader in seconds (Default: 5)\n"\
 " -t\n"\
@@ -554,19 +2176,63 @@ int main(int argc,char *argv[]){
 "   Null pulse cycles, appended to each newline (Default: off)\n"\
 " -w\n"\
 "   Wave shape; sine or square (Default: sine)\n"\
+" -D\n"\
+"   Demodulator; zerocross or goertzel (Default: zerocross)\n"\
+" -F\n"\
+"   Framed mode; sends the data in frames of up to 216 bytes with a\n"\
+"   CRC32 and 32 bytes of Reed-Solomon parity, which repair up to 16\n"\
+"   damaged bytes a frame, a lost byte counting as one. Both ends must\n"\
+"   use it. Decoding drops frames that cannot be repaired and reports\n"\
+"   what it did (Default: off)\n"\
+" -c\n"\
+"   Channels; each carries a KCS stream of its own and they are decoded\n"\
+"   side by side. Give a text file for each channel, or one to be split\n"\
+"   across them in blocks of 128 bytes, or 216 with -F (Default: 1)\n"\
+" -j\n"\
+"   Threads; decodes WAV and raw files in slices, and pipelines\n"\
+"   encoding with the output (Default: 1)\n"\
+" -B\n"\
+"   Batch; encodes or decodes many files on -j workers, then reports\n"\
+"   on each. Every text file given is paired with the recording of\n"\
+"   the same name with the -f extension appended (Default: .wav). If\n"\
+"   none are given, each line of stdin names a text file, then after\n"\
+"   a tab or space its recording\n"\
+" -b\n"\
+"   Ogg Vorbis bitrate in kbit/s; for encoding (Default: 64)\n"\
+" -L\n"\
+"   Soundcard latency in ms, and the size of each read when decoding.\n"\
+"   Decoding from the soundcard runs until interrupted, then reports\n"\
+"   the latency from each byte's stop bit to its output (Default: 20)\n"\
+" -v, --stats[=text|json]\n"\
+"   Statistics; counts what each stage of the modem does and the time\n"\
+"   it takes, and reports on stderr at the end, and every 5 s of audio\n"\
+"   when decoding from the soundcard (Default: off)\n"\
 " -h\n"\
 "   Print this info\n"\
 "FILES\n"\
 "   A text or binary file can be given as a non-option argument on the\n"\
-"   command line. If it is not specified, stdin or stdout will be used.\n");
- const char *opts = "hedna:s:l:t:w:f:";
+"   command line, or one for each channel with -c. If it is not\n"\
+"   specified, stdin or stdout will be used.\n");
+ const char *opts = "hednFBva:s:l:t:w:f:D:j:b:p:r:g:L:c:";
+ const struct option long_opts[] = {
+  {"stats",optional_argument,NULL,'S'},
+  {"help",no_argument,NULL,'h'},
+  {NULL,0,NULL,0}
+ };
  int opt;
- int encode = 0,decode = 0,help = 0,null_pulse = 0;
- char *flac_io = NULL;
- FILE *fp;
+ int encode = 0,decode = 0,help = 0,null_pulse = 0,batch = 0,error = 0;
+ char *file_io = NULL;
+ FILE *ip[KCS_CHANNELS_MAX];
+ struct kcs_output out;
+ struct kcs_fec_decoder fec;
+ struct kcs_params params;
+ struct kcs_encoder enc;
+ unsigned files,x;
  
+ kcs_started = kcs_seconds();
+ kcs_params_default(&params);
  opterr = 0;
- while((opt = getopt(argc,argv,opts)) != -1){
+ while((opt = getopt_long(argc,argv,opts,long_opts,NULL)) != -1){
   switch(opt){
    case 'h':
     help = 1;
@@ -581,26 +2247,98 @@ int main(int argc,char *argv[]){
    case 'n':
     null_pulse = 1;
     break;
+   case 'F':
+    KCS_FRAMED = 1;
+    break;
+   case 'B':
+    batch = 1;
+    break;
+   case 'v':
+    KCS_REPORT = KCS_REPORT_TEXT;
+    break;
+   case 'S':
+    if(optarg == NULL || strcmp(optarg,"text") == 0)
+     KCS_REPORT = KCS_REPORT_TEXT;
+    else if(strcmp(optarg,"json") == 0)
+     KCS_REPORT = KCS_REPORT_JSON;
+    else{
+     fprintf(stderr,"Unknown statistics format: %s\n",optarg);
+     return 0x1;
+    }
+    break;
    case 'a':
-    KCS_AMPLITUDE = atof(optarg);
+    params.amplitude = atof(optarg);
     break;
    case 's':
-    KCS_SQUELCH = atof(optarg);
+    params.squelch = atof(optarg);
+    break;
    case 'l':
-    KCS_LEADER = atoi(optarg);
+    params.leader = atoi(optarg);
     break;
    case 't':
-    KCS_TRAILER = atoi(optarg);
+    params.trailer = atoi(optarg);
     break;
    case 'w':
     if(strcmp(optarg,"square") == 0)
-     kcs_encode_wave = kcs_encode_square;
+     params.wave = KCS_WAVE_SQUARE;
     break;
    case 'f':
-    flac_io = optarg;
+    file_io = optarg;
+    break;
+   case 'j':
+    KCS_THREADS = max(1,atoi(optarg));
+    break;
+   case 'b':
+    KCS_BITRATE = atof(optarg) * 1000;
+    break;
+   case 'L':
+    KCS_LATENCY = max(1,atoi(optarg));
+    break;
+   case 'c':
+    if(atoi(optarg) < 1 || atoi(optarg) > KCS_CHANNELS_MAX){
+     fprintf(stderr,"Channels must be 1 to %d\n",KCS_CHANNELS_MAX);
+     return 0x1;
+    }
+    KCS_CHANNELS = atoi(optarg);
+    break;
+   case 'g':
+    if(strcmp(optarg,"auto") == 0)
+     params.gain = KCS_GAIN_AUTO;
+    else if(strcmp(optarg,"off") == 0)
+     params.gain = KCS_GAIN_FIXED;
+    else{
+     fprintf(stderr,"Unknown gain control: %s\n",optarg);
+     return 0x1;
+    }
+    break;
+   case 'p':
+    if(kcs_params_preset(&params,optarg) < 0){
+     fprintf(stderr,"Unknown preset: %s\n",optarg);
+     return 0x1;
+    }
+    break;
+   case 'r':
+    if(atoi(optarg) < KCS_RATE_MIN || atoi(optarg) > KCS_RATE_MAX){
+     fprintf(stderr,"Sample rate must be %u to %u\n",KCS_RATE_MIN,
+      KCS_RATE_MAX);
+     return 0x1;
+    }
+    params.framerate = atoi(optarg);
+    break;
+   case 'D':
+    if(strcmp(optarg,"goertzel") == 0)
+     params.demodulator = KCS_DEMOD_GOERTZEL;
+    else if(strcmp(optarg,"zerocross") == 0)
+     params.demodulator = KCS_DEMOD_ZEROCROSS;
+    else{
+     fprintf(stderr,"Unknown demodulator: %s\n",optarg);
+     return 0x1;
+    }
     break;
    case '?':
-    if(strchr(opts,optopt) != NULL)
+    if(optopt == 0)
+     fprintf(stderr,"Invalid option: %s\n",argv[optind - 1]);
+    else if(strchr(opts,optopt) != NULL)
      fprintf(stderr,"Option -%c requires an argument\n",(char)optopt);
     else
      fprintf(stderr,"Invalid option: -%c\n",(char)optopt);
@@ -610,6 +2348,11 @@ int main(int argc,char *argv[]){
     break;
   }
  }
+ files = argc - optind;
+ if(KCS_REPORT && !KCS_STATS_BUILT){
+  fputs("Statistics were compiled out of this build\n",stderr);
+  KCS_REPORT = 0;
+ }
  if(help){
   fprintf(stderr,USAGE_TEXT,argv[0]);
   return 0;
@@ -617,32 +2360,78 @@ int main(int argc,char *argv[]){
   fprintf(stderr,"Cannot encode AND decode!\n");
   fprintf(stderr,HELP_TEXT,argv[0]);
   return 2;
+ }else if(files > 1 && files != KCS_CHANNELS && !batch){
+  fprintf(stderr,"Give one file, or one for each of the %u channels\n",
+   KCS_CHANNELS);
+  return 2;
  }else if(encode){
   if(!null_pulse)
-   KCS_NULL_CYCLES = 0;
-  if(optind < argc){
-   if((fp = fopen(argv[optind],"rb")) == NULL)
-    return 1;
-  }else
-   fp = stdin;
-  if(flac_io != NULL)
-   kcs_encode_flac(fp,flac_io);
+   params.null_cycles = 0;
+  if(kcs_encoder_init(&enc,&params) < 0){
+   if(max(params.ones_freq,params.zero_freq) >= params.framerate / 2.0)
+    fprintf(stderr,"Tones must be under half the sample rate\n");
+   else
+    fprintf(stderr,"Out of memory\n");
+   return 1;
+  }
+  if(batch){
+   x = kcs_batch_files(&enc,&params,argv + optind,files,
+    (file_io != NULL)?file_io:".wav");
+   kcs_encoder_free(&enc);
+   if(KCS_REPORT)
+    kcs_stats_report(0,NULL);
+   return x;
+  }
+  if(kcs_input_open(ip,argv + optind,files) < 0){
+   kcs_encoder_free(&enc);
+   return 1;
+  }
+  if(file_io == NULL)
+   error = kcs_encode_pa(&enc,ip);
+  else if(kcs_file_format(file_io) == KCS_FORMAT_FLAC)
+   error = kcs_encode_flac(&enc,ip,file_io);
+  else if(kcs_file_format(file_io) == KCS_FORMAT_OGG)
+   error = kcs_encode_ogg(&enc,ip,file_io);
   else
-   kcs_encode_pa(fp);
-  fclose(fp);
-  return 0;
+   error = kcs_encode_file(&enc,ip,file_io,kcs_file_format(file_io));
+  kcs_encoder_free(&enc);
+  for(x = 0;x < ((files > 1)?KCS_CHANNELS:1);x++){
+   if(ferror(ip[x]))
+    error = -1;
+   fclose(ip[x]);
+  }
+  if(KCS_REPORT)
+   kcs_stats_report(0,NULL);
+  return (error < 0)?1:0;
  }else if(decode){
-  if(optind < argc){
-   if((fp = fopen(argv[optind],"wb")) == NULL)
-    return 1;
-  }else
-   fp = stdout;
-  if(flac_io != NULL)
-   kcs_decode_flac(fp,flac_io);
+  if(batch){
+   x = kcs_batch_files(NULL,&params,argv + optind,files,
+    (file_io != NULL)?file_io:".wav");
+   if(KCS_REPORT)
+    kcs_stats_report(1,NULL);
+   return x;
+  }
+  if(kcs_output_open(&out,argv + optind,files) < 0)
+   return 1;
+  if(file_io == NULL)
+   error = kcs_decode_pa(&params,&out);
+  else if(kcs_file_format(file_io) == KCS_FORMAT_FLAC)
+   error = kcs_decode_flac(&params,&out,file_io);
+  else if(kcs_file_format(file_io) == KCS_FORMAT_OGG)
+   error = kcs_decode_ogg(&params,&out,file_io);
   else
-   kcs_decode_pa(fp);
-  fclose(fp);
-  return 0;
+   error = kcs_decode_file(&params,&out,file_io,kcs_file_format(file_io));
+  if(kcs_output_error(&out))
+   error = -1;
+  kcs_output_frames(&out,&fec);
+  if(KCS_REPORT)
+   kcs_stats_report(1,KCS_FRAMED?&fec:NULL);
+  else if(KCS_FRAMED)
+   fprintf(stderr,"Frames: %lu passed, %lu bytes repaired, %lu beyond "
+    "repair, %lu missing\n",fec.frames,fec.corrected,fec.failed,fec.missed);
+  if(kcs_output_close(&out) < 0)
+   error = -1;
+  return (error < 0)?1:0;
  }else{
   fprintf(stderr,"No arguments given.\n");
   fprintf(stderr,HELP_TEXT,argv[0]);
@@ -0,0 +1,336 @@
+/* KiloCycleS KCS Modem library
+
+   The modem itself, without any audio backends. Every stream carries its
+   own parameters and scratch space in a kcs_encoder or kcs_decoder, so a
+   process can run any number of streams at once, each from one thread.
+
+   Encoding: kcs_encoder_init(), then kcs_encoder_feed() bytes and
+   kcs_encoder_pull() signed 16-bit mono samples as they become ready,
+   and kcs_encoder_finish() once the input is done to queue the trailer.
+   The encoder queues bytes and synthesises only what is pulled, so however
+   long the leader, trailer and null pulses, it holds no more samples than
+   the caller asks for at a time.
+   Decoding is the other way around: kcs_decoder_feed() samples,
+   kcs_decoder_pull() bytes and kcs_decoder_finish() at the end.
+
+   kcs_encode_block_into() and kcs_decode_block() are the lower level calls
+   underneath, for callers that manage their own sample buffers. The
+   encoding calls carry the stream's place from one call to the next in a
+   kcs_encode_state of the caller's, so that one encoder can serve any
+   number of streams. The decoder keeps its place in the stream between
+   kcs_decode_block() calls, so blocks may be any length and split bytes
+   anywhere, and kcs_decode_end() flushes it at the end of the stream.
+
+   Framed mode is an optional layer over the bytes: kcs_fec_frame() wraps
+   payload in frames with a CRC32 and Reed-Solomon parity before encoding,
+   and kcs_fec_deframe() repairs and unwraps the bytes that were decoded.
+*/
+
+#ifndef KCS_H
+#define KCS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define KCS_WAVE_SINE 0
+#define KCS_WAVE_SQUARE 1
+
+#define KCS_DEMOD_ZEROCROSS 0
+#define KCS_DEMOD_GOERTZEL 1
+
+#define KCS_GAIN_FIXED 0
+#define KCS_GAIN_AUTO 1
+
+struct kcs_params {
+ unsigned framerate;
+ unsigned ones_freq;
+ unsigned zero_freq;
+ unsigned ones_cycles; /* Cycles per bit */
+ unsigned zero_cycles;
+ unsigned null_cycles; /* Cycles of ones_freq after each newline */
+ double amplitude;
+ double squelch; /* Of full scale, or of the envelope with KCS_GAIN_AUTO */
+ unsigned leader; /* Seconds of carrier */
+ unsigned trailer;
+ int wave;
+ int demodulator;
+ int gain; /* DC removal and AGC ahead of the demodulator */
+};
+
+/* Standard 1200 baud KCS at 44.1 kHz */
+void kcs_params_default(struct kcs_params *params);
+/* Sets the tones and cycles per bit from a preset: "300" or "kcs" for
+   the original 300 baud standard, "1200" or "cuts" for 1200 baud CUTS, or
+   "ONES_FREQ:ONES_CYCLES:ZERO_FREQ:ZERO_CYCLES". Returns -1 if the preset
+   is unknown or invalid. */
+int kcs_params_preset(struct kcs_params *params,const char *preset);
+
+/* === ENCODER ===
+   Tones come from a wavetable stepped through by a fixed-point phase
+   accumulator, so they are exact at any frame rate and each bit lasts
+   exactly its cycles, however many samples that is. Times are in 2^-32
+   of a sample and phases in 2^-32 of a cycle. A square wave is summed
+   from only the harmonics under Nyquist, which would otherwise alias
+   between the tones at the lower frame rates. */
+#define KCS_WAVE_BITS 12 /* Wavetable of 2^KCS_WAVE_BITS samples */
+#define KCS_BYTE_RUNS 10 /* Most runs of a tone a byte can take */
+
+/* Where a stream has got to: how far its next sample lies past the end of
+   the last bit. Starts at zero and stays under one sample. */
+struct kcs_encode_state {
+ uint32_t offset;
+};
+
+struct kcs_encoder {
+ struct kcs_params params;
+ int16_t *wave_table; /* A cycle of the wave, and its first sample again */
+ int shared; /* wave_table belongs to the encoder it was shared from */
+ uint32_t step[2]; /* Phase a sample of the zero and ones tones */
+ uint64_t bit_time[2]; /* Length of a bit of each */
+ uint64_t null_time;
+ struct kcs_encode_state state; /* Of the streaming calls */
+ /* Bytes fed but not yet synthesised */
+ char *queue;
+ size_t queue_start,queue_length,queue_capacity;
+ /* The runs of the byte or carrier being synthesised, the next to start,
+    and what is left of the one before it */
+ unsigned char tone[KCS_BYTE_RUNS];
+ uint64_t time[KCS_BYTE_RUNS];
+ unsigned run,runs;
+ uint32_t phase;
+ unsigned left;
+ struct kcs_encode_state end; /* Where what has been fed ends */
+ size_t length; /* Samples fed but not yet pulled */
+ int started,finished; /* Leader queued; trailer queued, then begun */
+};
+
+/* Fails for a tone at or above half the frame rate */
+int kcs_encoder_init(struct kcs_encoder *enc,const struct kcs_params *params);
+/* A stream of its own from another encoder's parameters and wavetable,
+   which it reads without building; from must outlive it */
+void kcs_encoder_share(struct kcs_encoder *enc,const struct kcs_encoder *from);
+void kcs_encoder_free(struct kcs_encoder *enc);
+
+int kcs_encoder_feed(struct kcs_encoder *enc,const char *bytes,size_t length);
+int kcs_encoder_finish(struct kcs_encoder *enc);
+/* Returns how many samples it pulled, but may write anywhere up to max */
+size_t kcs_encoder_pull(struct kcs_encoder *enc,int16_t *samples,size_t max);
+
+int16_t *kcs_encode_carrier(
+ const struct kcs_encoder *enc,
+ struct kcs_encode_state *state,
+ unsigned seconds,
+ unsigned *length
+);
+/* Samples the block comes to from state, which it leaves as it is */
+unsigned kcs_encode_block_length(
+ const struct kcs_encoder *enc,
+ const struct kcs_encode_state *state,
+ const char *block,
+ unsigned block_length
+);
+unsigned kcs_encode_block_into(
+ const struct kcs_encoder *enc,
+ struct kcs_encode_state *state,
+ const char *block,
+ unsigned block_length,
+ int16_t *data /* Must hold kcs_encode_block_length() samples */
+);
+int16_t *kcs_encode_block(
+ const struct kcs_encoder *enc,
+ struct kcs_encode_state *state,
+ const char *block,
+ unsigned block_length,
+ unsigned *length
+);
+
+/* 32-bit output for sinks that take it, such as libFLAC */
+unsigned kcs_encode_block_into32(
+ const struct kcs_encoder *enc,
+ struct kcs_encode_state *state,
+ const char *block,
+ unsigned block_length,
+ int32_t *data /* Must hold kcs_encode_block_length() samples */
+);
+void kcs_widen(const int16_t *src,int32_t *dst,size_t length);
+
+/* === STATISTICS ===
+   A libkcs built with KCS_STATS defined has each decoder count what its
+   stages see, and the time they take, in its stats. Built without, the
+   counting is compiled out and the counts stay at zero. */
+#define KCS_STAGE_DECIMATE 0 /* Anti-alias filter down to the internal rate */
+#define KCS_STAGE_CONDITION 1 /* DC removal and AGC */
+#define KCS_STAGE_DEMODULATE 2
+#define KCS_STAGE_FRAME 3
+#define KCS_STAGES 4
+
+struct kcs_stats {
+ uint64_t samples; /* Samples decoded, at the rate they were fed */
+ uint64_t crosses; /* Falling zero crosses, or Goertzel hops */
+ uint64_t quiet; /* Of those, under squelch */
+ uint64_t odd; /* Cycles of neither tone's length */
+ uint64_t cycles; /* Cycles of a tone */
+ uint64_t bytes; /* Bytes framed */
+ uint64_t resyncs; /* Start bits the framer gave up on */
+ uint64_t ns[KCS_STAGES]; /* Nanoseconds in each stage */
+};
+
+/* Whether this libkcs counts anything */
+int kcs_stats_enabled(void);
+
+/* === DECODER ===
+   Samples may come at any frame rate from 8 to 192 kHz. The decoder
+   filters and decimates them by a whole factor to about the lowest rate
+   its demodulator works at and demodulates at that: four samples a
+   period of the higher tone for zero crosses, so 11025 Hz for a 44.1 kHz
+   stream, and sixteen for Goertzel, so 48 kHz for a 96 kHz one. Slower
+   streams are interpolated by a whole factor up to that rate instead, so
+   Goertzel demodulates an 8 kHz stream at 40 kHz. */
+#define KCS_RATE_MIN 8000
+#define KCS_RATE_MAX 192000
+#define KCS_DECIMATE_TAPS 4 /* Filter taps per sample demodulated */
+#define KCS_INTERPOLATE_TAPS 16 /* Filter taps per sample fed */
+
+/* Per-stream decoder state and scratch, sized from the block length so
+   that kcs_decode_block() does not allocate once the stream is running.
+   Stream positions count samples from the start of the stream, at the
+   internal rate inside the decoder but at the rate fed in text_pos. */
+struct kcs_decoder {
+ struct kcs_params params; /* With the internal frame rate */
+ unsigned rate; /* Frame rate of the samples fed */
+ unsigned factor; /* Samples fed per sample demodulated */
+ unsigned up; /* Samples demodulated per sample fed; one of these is 1 */
+ int16_t *taps; /* Low-pass filter, see kcs_decoder_taps() */
+ unsigned tap_count;
+ int16_t *input; /* The filter's history of samples fed, then as many more */
+ int16_t *resampled;
+ unsigned skip; /* Samples to feed before the next one kept, or to drop */
+ unsigned (*demodulate)(struct kcs_decoder *,const int16_t *,unsigned,int16_t,
+  int);
+ unsigned (*frame)(struct kcs_decoder *,unsigned,int);
+ unsigned char *cycle_class; /* Tone of each zero cross distance */
+ unsigned cycle_class_length;
+ double clock; /* Tracked period over the nominal period */
+ unsigned clock_count;
+ unsigned char *cyclefreq;
+ size_t *cyclefreq_end; /* Stream position at the end of each cycle */
+ char *text;
+ size_t *text_pos; /* Stream position of each byte's start bit */
+ uint64_t *neg_mask;
+ uint64_t *loud_mask;
+ int16_t *reference; /* Interleaved Q14 references, see kcs_correlate */
+ unsigned reference_length;
+ int32_t *correlation;
+ signed char *label;
+ int16_t *samples; /* Demodulator input, after the history it keeps */
+ unsigned capacity; /* Largest block length the scratch arrays can hold */
+ /* Carried from one block to the next, so each sample is looked at once */
+ size_t position; /* Samples demodulated so far */
+ int16_t *chunk; /* Samples waiting for a whole AGC chunk */
+ unsigned chunk_length,chunk_capacity;
+ int32_t center,envelope;
+ double cross; /* Last falling zero cross, or negative before the first */
+ int16_t last_sample;
+ int loud; /* A sample since the last cross passed squelch */
+ unsigned hop,hops; /* Goertzel hop length and hops per window */
+ unsigned history_length,history_capacity;
+ size_t hop_count; /* Whole hops correlated so far */
+ int run_tone; /* Goertzel label of the run in progress, or -1 */
+ size_t run_start,run_last; /* Where it starts and its last cycle ends */
+ size_t run_first; /* Hop of its first label */
+ unsigned run_cycles; /* Cycles of it emitted so far */
+ double edge; /* Samples the labels stretch zero runs by */
+ unsigned edge_count;
+ size_t carrier_next; /* Next hop whose phase is to be measured */
+ double carrier_re,carrier_im;
+ unsigned carrier_count;
+ int span_open;
+ size_t span_start;
+ double span_nominal;
+ unsigned pending; /* Cycles of an unfinished byte, kept at the front */
+ unsigned frame_cycles; /* Most cycles a byte can take */
+ size_t frame_origin; /* End of the cycle before the first pending one */
+ /* Samples fed but not yet decoded, and bytes decoded but not pulled */
+ int16_t *window;
+ unsigned window_length,window_capacity;
+ char *queue;
+ size_t queue_start,queue_length,queue_capacity;
+ struct kcs_stats stats;
+};
+
+/* Fails for a frame rate outside KCS_RATE_MIN to KCS_RATE_MAX, for tones
+   that are the same or at or above half of it, and for no cycles a bit */
+int kcs_decoder_init(struct kcs_decoder *dec,const struct kcs_params *params);
+void kcs_decoder_free(struct kcs_decoder *dec);
+
+int kcs_decoder_feed(
+ struct kcs_decoder *dec,
+ const int16_t *samples,
+ size_t length
+);
+int kcs_decoder_finish(struct kcs_decoder *dec);
+size_t kcs_decoder_pull(struct kcs_decoder *dec,char *bytes,size_t max);
+
+/* Number of samples the streaming calls hand to kcs_decode_block() at a
+   time; a good block length for other callers too */
+unsigned kcs_decode_window(const struct kcs_params *params);
+/* Decodes the next data_length samples of the stream, returning the bytes
+   whose stop bits they complete and their start positions in text_pos */
+char *kcs_decode_block(
+ struct kcs_decoder *dec,
+ const int16_t *data,
+ unsigned data_length,
+ unsigned *length
+);
+/* Decodes what the decoder still holds once the stream has ended */
+char *kcs_decode_end(struct kcs_decoder *dec,unsigned *length);
+
+/* === FEC FRAMING ===
+   Each frame is a sync word, the payload length three times over and a
+   shortened Reed-Solomon (255,223) codeword: the length again, a 16-bit
+   sequence number, the payload and a CRC32 of the three, then 32 parity
+   bytes. Up to 16 damaged bytes a frame are repaired, a byte the framer
+   dropped counting as one; frames that cannot be are dropped, and the
+   deframer hunts for the next sync word, so bytes lost or added by the
+   demodulator cost at most the frames around them. */
+#define KCS_FEC_SYNC0 0x16
+#define KCS_FEC_SYNC1 0x4B
+#define KCS_FEC_HEADER 5 /* Sync word and the three length bytes */
+#define KCS_FEC_FIELDS 7 /* Length, sequence and CRC in the codeword */
+#define KCS_FEC_PARITY 32
+#define KCS_FEC_PAYLOAD 216 /* Most payload bytes in a frame */
+#define KCS_FEC_FRAME \
+ (KCS_FEC_HEADER + KCS_FEC_FIELDS + KCS_FEC_PAYLOAD + KCS_FEC_PARITY)
+
+struct kcs_fec_decoder {
+ unsigned char frame[KCS_FEC_FRAME]; /* From a likely sync word on */
+ unsigned length;
+ unsigned sequence; /* Expected from the next frame */
+ int started;
+ unsigned long frames; /* Frames passed on */
+ unsigned long corrected; /* Bytes repaired in them */
+ unsigned long failed; /* Frame candidates beyond repair */
+ unsigned long missed; /* Gaps in the sequence numbers */
+};
+
+/* Frames length bytes of payload, 1 to KCS_FEC_PAYLOAD, into frame, which
+   must hold KCS_FEC_FRAME bytes. Returns the frame length, or 0 for a
+   length out of range. */
+unsigned kcs_fec_frame(
+ const char *payload,
+ unsigned length,
+ unsigned sequence,
+ char *frame
+);
+void kcs_fec_decoder_init(struct kcs_fec_decoder *fec);
+/* Takes the next length decoded bytes and returns how many payload bytes
+   of the frames they complete it wrote; payload must hold length +
+   KCS_FEC_PAYLOAD bytes */
+unsigned kcs_fec_deframe(
+ struct kcs_fec_decoder *fec,
+ const char *bytes,
+ unsigned length,
+ char *payload
+);
+
+#endif
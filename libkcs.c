@@ -0,0 +1,2735 @@
+/* KiloCycleS KCS Modem library
+   Author: JSH
+
+   The modem without its audio backends; see kcs.h for the interface.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "kcs.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KCS_X86
+#endif
+
+static int max(int x,int y){
+ return (x > y)?x:y;
+}
+
+static int min(int x,int y){
+ return (x < y)?x:y;
+}
+
+void kcs_params_default(struct kcs_params *params){
+ params->framerate = 44100;
+ params->ones_freq = 2400;
+ params->zero_freq = 1200;
+ params->ones_cycles = 2;
+ params->zero_cycles = 1;
+ params->null_cycles = 800;
+ params->amplitude = 0.8;
+ params->squelch = 0.25;
+ params->leader = 5;
+ params->trailer = 5;
+ params->wave = KCS_WAVE_SINE;
+ params->demodulator = KCS_DEMOD_ZEROCROSS;
+ params->gain = KCS_GAIN_AUTO;
+}
+
+int kcs_params_preset(struct kcs_params *params,const char *preset){
+ unsigned ones_freq,ones_cycles,zero_freq,zero_cycles;
+ char end;
+ 
+ if(strcmp(preset,"300") == 0 || strcasecmp(preset,"kcs") == 0){
+  ones_freq = 2400;
+  ones_cycles = 8;
+  zero_freq = 1200;
+  zero_cycles = 4;
+ }else if(strcmp(preset,"1200") == 0 || strcasecmp(preset,"cuts") == 0){
+  ones_freq = 2400;
+  ones_cycles = 2;
+  zero_freq = 1200;
+  zero_cycles = 1;
+ }else if(sscanf(preset,"%u:%u:%u:%u%c",
+  &ones_freq,&ones_cycles,&zero_freq,&zero_cycles,&end) != 4)
+  return -1;
+ 
+ /* The decoder tells the tones apart by their period */
+ if(
+  ones_cycles == 0 || zero_cycles == 0 ||
+  ones_freq == 0 || zero_freq == 0 || ones_freq == zero_freq
+ )
+  return -1;
+ params->ones_freq = ones_freq;
+ params->ones_cycles = ones_cycles;
+ params->zero_freq = zero_freq;
+ params->zero_cycles = zero_cycles;
+ return 0;
+}
+
+static int kcs_queue_reserve(
+ void **queue,
+ size_t *start,
+ size_t length,
+ size_t *capacity,
+ size_t extra,
+ size_t size
+){
+ /* Makes room for extra items after the length queued from start, moving
+    them to the front first if the queue has to grow or wrap */
+ size_t new_capacity;
+ void *new_queue;
+ 
+ if(*start + length + extra <= *capacity)
+  return 0;
+ if(*start){
+  memmove(*queue,(char *)*queue + *start * size,length * size);
+  *start = 0;
+ }
+ if(length + extra > *capacity){
+  new_capacity = (*capacity * 2 > length + extra)?*capacity * 2:length + extra;
+  if((new_queue = realloc(*queue,new_capacity * size)) == NULL)
+   return -1;
+  *queue = new_queue;
+  *capacity = new_capacity;
+ }
+ return 0;
+}
+
+/* === ENCODER === */
+
+void kcs_encoder_free(struct kcs_encoder *enc){
+ if(!enc->shared)
+  free(enc->wave_table);
+ free(enc->queue);
+ enc->wave_table = NULL;
+ enc->queue = NULL;
+ enc->queue_start = enc->queue_length = enc->queue_capacity = 0;
+}
+
+static double kcs_square_sum(unsigned x,unsigned size,unsigned harmonics){
+ /* The first odd harmonics of a square wave at x of size, from its peak */
+ double sum = 0;
+ unsigned k;
+ 
+ for(k = 1;k < harmonics * 2;k += 2)
+  sum += ((k % 4 == 1)?1:-1) * cos(2 * M_PI * k * x / size) / k;
+ return sum;
+}
+
+int kcs_encoder_init(struct kcs_encoder *enc,const struct kcs_params *params){
+ /* Tabulates a cycle of the wave from its peak, so that the falling zero
+    cross lands a quarter cycle in, where the decoder expects it, and
+    works out the tones' phase steps and the bits' lengths */
+ const unsigned size = 1 << KCS_WAVE_BITS;
+ const double scale = 4294967296.0; /* 2^32 */
+ double peak = 0,level = 0;
+ unsigned harmonics = 1,x;
+ 
+ memset(enc,0,sizeof(*enc));
+ enc->params = *params;
+ if(
+  params->ones_freq == 0 || params->zero_freq == 0 ||
+  params->ones_freq >= params->framerate / 2.0 ||
+  params->zero_freq >= params->framerate / 2.0
+ )
+  return -1;
+ 
+ if((enc->wave_table = malloc((size + 1) * sizeof(*enc->wave_table))) == NULL)
+  return -1;
+ if(params->wave == KCS_WAVE_SQUARE){
+  /* Keeps the odd harmonics that the higher tone holds under Nyquist, as
+     those above fold back between the tones, and brings the peak of
+     their ringing to the amplitude */
+  while((harmonics * 2 + 1) * fmax(params->ones_freq,params->zero_freq) <
+   params->framerate / 2.0)
+   harmonics++;
+  for(x = 0;x <= size;x++)
+   peak = fmax(peak,kcs_square_sum(x,size,harmonics));
+  level = fmin(1.0,fmax(0.0,params->amplitude)) * INT16_MAX / peak;
+ }
+ for(x = 0;x <= size;x++){
+  if(params->wave == KCS_WAVE_SQUARE)
+   enc->wave_table[x] = kcs_square_sum(x,size,harmonics) * level;
+  else
+   /* If amplitude is greater than 1.0, clip the sine wave */
+   enc->wave_table[x] = fmax(fmin(
+    params->amplitude * cos(2 * M_PI * x / size),1.0),-1.0) * INT16_MAX;
+ }
+ 
+ enc->step[0] = round(scale * params->zero_freq / params->framerate);
+ enc->step[1] = round(scale * params->ones_freq / params->framerate);
+ enc->bit_time[0] = round(scale * params->framerate * params->zero_cycles /
+  params->zero_freq);
+ enc->bit_time[1] = round(scale * params->framerate * params->ones_cycles /
+  params->ones_freq);
+ enc->null_time = round(scale * params->framerate * params->null_cycles /
+  params->ones_freq);
+ return 0;
+}
+
+void kcs_encoder_share(struct kcs_encoder *enc,const struct kcs_encoder *from){
+ memset(enc,0,sizeof(*enc));
+ enc->params = from->params;
+ enc->wave_table = from->wave_table;
+ enc->shared = 1;
+ memcpy(enc->step,from->step,sizeof(enc->step));
+ memcpy(enc->bit_time,from->bit_time,sizeof(enc->bit_time));
+ enc->null_time = from->null_time;
+}
+
+/* === SAMPLE SCANNING ===
+   The decoder front end reduces each block to two bitmasks, one bit per
+   sample: samples below zero, and samples at or above the squelch level.
+   Bit i of word w describes sample w * 64 + i. Cycles run from one falling
+   zero cross to the next, and a cycle passes squelch if any of its samples
+   is set in the loud mask. */
+typedef void (*scan_function)(const int16_t *,unsigned,int16_t,
+ uint64_t *,uint64_t *);
+
+static void kcs_scan_scalar(
+ const int16_t *data,
+ unsigned data_length,
+ int16_t sql_pulse,
+ uint64_t *neg,
+ uint64_t *loud
+){
+ unsigned x,y,word_length;
+ uint64_t n,l;
+ 
+ for(x = 0;x < data_length;x += 64){
+  word_length = min(64,data_length - x);
+  for(n = l = 0,y = 0;y < word_length;y++){
+   n |= (uint64_t)(data[x + y] < 0) << y;
+   l |= (uint64_t)(data[x + y] >= sql_pulse) << y;
+  }
+  neg[x / 64] = n;
+  loud[x / 64] = l;
+ }
+}
+
+#ifdef KCS_X86
+__attribute__((target("sse2")))
+static void kcs_scan_sse2(
+ const int16_t *data,
+ unsigned data_length,
+ int16_t sql_pulse,
+ uint64_t *neg,
+ uint64_t *loud
+){
+ const __m128i zero = _mm_setzero_si128();
+ const __m128i sql = _mm_set1_epi16(sql_pulse - 1);
+ __m128i a,b;
+ unsigned x,y,full_length = data_length & ~63u;
+ uint64_t n,l;
+ 
+ for(x = 0;x < full_length;x += 64){
+  for(n = l = 0,y = 0;y < 64;y += 16){
+   a = _mm_loadu_si128((const __m128i *)(data + x + y));
+   b = _mm_loadu_si128((const __m128i *)(data + x + y + 8));
+   n |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_packs_epi16(
+    _mm_cmplt_epi16(a,zero),_mm_cmplt_epi16(b,zero))) << y;
+   l |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_packs_epi16(
+    _mm_cmpgt_epi16(a,sql),_mm_cmpgt_epi16(b,sql))) << y;
+  }
+  neg[x / 64] = n;
+  loud[x / 64] = l;
+ }
+ kcs_scan_scalar(data + x,data_length - x,sql_pulse,neg + x / 64,loud + x / 64);
+}
+
+__attribute__((target("avx2")))
+static void kcs_scan_avx2(
+ const int16_t *data,
+ unsigned data_length,
+ int16_t sql_pulse,
+ uint64_t *neg,
+ uint64_t *loud
+){
+ const __m256i zero = _mm256_setzero_si256();
+ const __m256i sql = _mm256_set1_epi16(sql_pulse - 1);
+ __m256i a,b;
+ unsigned x,y,full_length = data_length & ~63u;
+ uint64_t n,l;
+ 
+ /* packs works within 128-bit lanes, so the permute puts samples back
+    in order before the bytes are gathered into a mask */
+ for(x = 0;x < full_length;x += 64){
+  for(n = l = 0,y = 0;y < 64;y += 32){
+   a = _mm256_loadu_si256((const __m256i *)(data + x + y));
+   b = _mm256_loadu_si256((const __m256i *)(data + x + y + 16));
+   n |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_permute4x64_epi64(
+    _mm256_packs_epi16(_mm256_cmpgt_epi16(zero,a),_mm256_cmpgt_epi16(zero,b)),
+    0xD8)) << y;
+   l |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_permute4x64_epi64(
+    _mm256_packs_epi16(_mm256_cmpgt_epi16(a,sql),_mm256_cmpgt_epi16(b,sql)),
+    0xD8)) << y;
+  }
+  neg[x / 64] = n;
+  loud[x / 64] = l;
+ }
+ _mm256_zeroupper();
+ kcs_scan_scalar(data + x,data_length - x,sql_pulse,neg + x / 64,loud + x / 64);
+}
+#endif
+
+/* === TONE CORRELATION ===
+   The correlator demodulator multiplies the block with Q14 cosine and
+   sine references for both tones and sums the products over hops of
+   hop_pairs sample pairs, an even number. The references are interleaved
+   by sample pair, eight values per pair (cos and sin of ones_freq,
+   then of zero_freq), and repeat after an even ref_pairs pairs. The
+   four hop sums are kept in sums; a window of the last window_hops hops
+   is then labelled 1 or 0 by its stronger tone, or -1 if neither reaches
+   sql_power. label[x] is the label of the window ending with hop x, for
+   x from window_hops - 1. */
+typedef void (*correlate_function)(const int16_t *,unsigned,unsigned,
+ unsigned,const int16_t *,unsigned,float,int32_t *,signed char *);
+
+static void kcs_correlate_scalar(
+ const int16_t *data,
+ unsigned hops,
+ unsigned hop_pairs,
+ unsigned window_hops,
+ const int16_t *ref,
+ unsigned ref_pairs,
+ float sql_power,
+ int32_t *sums,
+ signed char *label
+){
+ unsigned x,y,z,k = 0;
+ int32_t window[4] = {0,0,0,0};
+ float ones_power,zero_power;
+ 
+ for(x = 0;x < hops;x++){
+  for(y = 0;y < 4;y++)
+   sums[x * 4 + y] = 0;
+  for(z = 0;z < hop_pairs;z++){
+   for(y = 0;y < 4;y++)
+    sums[x * 4 + y] += (data[0] * ref[k * 8 + y * 2] +
+     data[1] * ref[k * 8 + y * 2 + 1]) >> 14;
+   data += 2;
+   if(++k == ref_pairs)
+    k = 0;
+  }
+  for(y = 0;y < 4;y++)
+   window[y] += sums[x * 4 + y] - ((x >= window_hops)?
+    sums[(x - window_hops) * 4 + y]:0);
+  
+  ones_power = (float)window[0] * window[0] + (float)window[1] * window[1];
+  zero_power = (float)window[2] * window[2] + (float)window[3] * window[3];
+  if(ones_power < sql_power && zero_power < sql_power)
+   label[x] = -1;
+  else
+   label[x] = ones_power > zero_power;
+ }
+}
+
+#ifdef KCS_X86
+__attribute__((target("sse2")))
+static inline signed char kcs_label_sse2(
+ __m128i *window,
+ __m128i add,
+ __m128i sub,
+ float sql_power
+){
+ /* Slides the window and labels it, in the same order of float
+    operations as kcs_correlate_scalar() */
+ __m128 power;
+ float ones_power,zero_power;
+ 
+ *window = _mm_sub_epi32(_mm_add_epi32(*window,add),sub);
+ power = _mm_cvtepi32_ps(*window);
+ power = _mm_mul_ps(power,power);
+ power = _mm_add_ps(power,_mm_shuffle_ps(power,power,_MM_SHUFFLE(2,3,0,1)));
+ ones_power = _mm_cvtss_f32(power);
+ zero_power = _mm_cvtss_f32(_mm_movehl_ps(power,power));
+ if(ones_power < sql_power && zero_power < sql_power)
+  return -1;
+ return ones_power > zero_power;
+}
+
+__attribute__((target("sse2")))
+static void kcs_correlate_sse2(
+ const int16_t *data,
+ unsigned hops,
+ unsigned hop_pairs,
+ unsigned window_hops,
+ const int16_t *ref,
+ unsigned ref_pairs,
+ float sql_power,
+ int32_t *sums,
+ signed char *label
+){
+ /* One sample pair is broadcast against all four references at once */
+ __m128i sum,window = _mm_setzero_si128();
+ int32_t pair;
+ unsigned x,z,k = 0;
+ 
+ for(x = 0;x < hops;x++){
+  sum = _mm_setzero_si128();
+  for(z = 0;z < hop_pairs;z++){
+   memcpy(&pair,data,sizeof(pair));
+   sum = _mm_add_epi32(sum,_mm_srai_epi32(_mm_madd_epi16(_mm_set1_epi32(pair),
+    _mm_loadu_si128((const __m128i *)(ref + k * 8))),14));
+   data += 2;
+   if(++k == ref_pairs)
+    k = 0;
+  }
+  _mm_storeu_si128((__m128i *)(sums + x * 4),sum);
+  label[x] = kcs_label_sse2(&window,sum,(x >= window_hops)?
+   _mm_loadu_si128((const __m128i *)(sums + (x - window_hops) * 4)):
+   _mm_setzero_si128(),sql_power);
+ }
+}
+
+__attribute__((target("avx2")))
+static void kcs_correlate_avx2(
+ const int16_t *data,
+ unsigned hops,
+ unsigned hop_pairs,
+ unsigned window_hops,
+ const int16_t *ref,
+ unsigned ref_pairs,
+ float sql_power,
+ int32_t *sums,
+ signed char *label
+){
+ /* Two sample pairs at a time, one per 128-bit lane */
+ const __m256i spread = _mm256_setr_epi32(0,0,0,0,1,1,1,1);
+ __m256i wide;
+ __m128i sum,window = _mm_setzero_si128();
+ unsigned x,z,k = 0;
+ 
+ for(x = 0;x < hops;x++){
+  wide = _mm256_setzero_si256();
+  for(z = 0;z < hop_pairs;z += 2){
+   wide = _mm256_add_epi32(wide,_mm256_srai_epi32(_mm256_madd_epi16(
+    _mm256_permutevar8x32_epi32(_mm256_castsi128_si256(
+     _mm_loadl_epi64((const __m128i *)data)),spread),
+    _mm256_loadu_si256((const __m256i *)(ref + k * 8))),14));
+   data += 4;
+   if((k += 2) == ref_pairs)
+    k = 0;
+  }
+  sum = _mm_add_epi32(
+   _mm256_castsi256_si128(wide),_mm256_extracti128_si256(wide,1));
+  _mm_storeu_si128((__m128i *)(sums + x * 4),sum);
+  label[x] = kcs_label_sse2(&window,sum,(x >= window_hops)?
+   _mm_loadu_si128((const __m128i *)(sums + (x - window_hops) * 4)):
+   _mm_setzero_si128(),sql_power);
+ }
+}
+#endif
+
+/* === SAMPLE WIDENING ===
+   Sign-extends 16-bit samples to 32 bits, for sinks such as libFLAC that
+   take 32-bit samples. */
+typedef void (*widen_function)(const int16_t *,int32_t *,size_t);
+
+static void kcs_widen_scalar(const int16_t *src,int32_t *dst,size_t length){
+ size_t x;
+ 
+ for(x = 0;x < length;x++)
+  dst[x] = src[x];
+}
+
+#ifdef KCS_X86
+__attribute__((target("sse2")))
+static void kcs_widen_sse2(const int16_t *src,int32_t *dst,size_t length){
+ /* Each sample is paired with itself and shifted back down */
+ __m128i a;
+ size_t x;
+ 
+ for(x = 0;x + 8 <= length;x += 8){
+  a = _mm_loadu_si128((const __m128i *)(src + x));
+  _mm_storeu_si128((__m128i *)(dst + x),
+   _mm_srai_epi32(_mm_unpacklo_epi16(a,a),16));
+  _mm_storeu_si128((__m128i *)(dst + x + 4),
+   _mm_srai_epi32(_mm_unpackhi_epi16(a,a),16));
+ }
+ kcs_widen_scalar(src + x,dst + x,length - x);
+}
+
+__attribute__((target("avx2")))
+static void kcs_widen_avx2(const int16_t *src,int32_t *dst,size_t length){
+ size_t x;
+ 
+ for(x = 0;x + 16 <= length;x += 16){
+  _mm256_storeu_si256((__m256i *)(dst + x),_mm256_cvtepi16_epi32(
+   _mm_loadu_si128((const __m128i *)(src + x))));
+  _mm256_storeu_si256((__m256i *)(dst + x + 8),_mm256_cvtepi16_epi32(
+   _mm_loadu_si128((const __m128i *)(src + x + 8))));
+ }
+ /* The tail call would otherwise run SSE code with the upper halves of
+    the registers dirty, which stalls on every instruction */
+ _mm256_zeroupper();
+ kcs_widen_sse2(src + x,dst + x,length - x);
+}
+#endif
+
+/* === LEVEL AND GAIN ===
+   Kernels for the conditioning stage ahead of the demodulators: the sum
+   and range of a chunk of samples, and the chunk moved onto its centre
+   line and scaled by a Q8 gain, saturating. */
+typedef void (*level_function)(const int16_t *,unsigned,int32_t *,
+ int16_t *,int16_t *);
+typedef void (*gain_function)(const int16_t *,unsigned,int16_t,int16_t,
+ int16_t *);
+
+static void kcs_level_scalar(
+ const int16_t *data,
+ unsigned data_length,
+ int32_t *sum,
+ int16_t *low,
+ int16_t *high
+){
+ unsigned x;
+ 
+ for(x = 0;x < data_length;x++){
+  *sum += data[x];
+  *low = min(*low,data[x]);
+  *high = max(*high,data[x]);
+ }
+}
+
+static void kcs_gain_scalar(
+ const int16_t *data,
+ unsigned data_length,
+ int16_t center,
+ int16_t gain,
+ int16_t *out
+){
+ int32_t level;
+ unsigned x;
+ 
+ for(x = 0;x < data_length;x++){
+  level = max(INT16_MIN,min(INT16_MAX,data[x] - center)) * gain >> 8;
+  out[x] = max(INT16_MIN,min(INT16_MAX,level));
+ }
+}
+
+#ifdef KCS_X86
+__attribute__((target("sse2")))
+static inline void kcs_level_reduce(
+ __m128i sums,
+ __m128i lows,
+ __m128i highs,
+ int32_t *sum,
+ int16_t *low,
+ int16_t *high
+){
+ /* Folds the lanes in registers; a store and reload of each vector costs
+    more than the loop itself on a chunk this short */
+ sums = _mm_add_epi32(sums,_mm_shuffle_epi32(sums,0x4E));
+ sums = _mm_add_epi32(sums,_mm_shuffle_epi32(sums,0xB1));
+ lows = _mm_min_epi16(lows,_mm_srli_si128(lows,8));
+ lows = _mm_min_epi16(lows,_mm_srli_si128(lows,4));
+ lows = _mm_min_epi16(lows,_mm_srli_si128(lows,2));
+ highs = _mm_max_epi16(highs,_mm_srli_si128(highs,8));
+ highs = _mm_max_epi16(highs,_mm_srli_si128(highs,4));
+ highs = _mm_max_epi16(highs,_mm_srli_si128(highs,2));
+ *sum += _mm_cvtsi128_si32(sums);
+ *low = _mm_cvtsi128_si32(lows);
+ *high = _mm_cvtsi128_si32(highs);
+}
+
+__attribute__((target("sse2")))
+static void kcs_level_sse2(
+ const int16_t *data,
+ unsigned data_length,
+ int32_t *sum,
+ int16_t *low,
+ int16_t *high
+){
+ const __m128i one = _mm_set1_epi16(1);
+ __m128i a,sums = _mm_setzero_si128();
+ __m128i lows = _mm_set1_epi16(*low),highs = _mm_set1_epi16(*high);
+ unsigned x;
+ 
+ for(x = 0;x + 8 <= data_length;x += 8){
+  a = _mm_loadu_si128((const __m128i *)(data + x));
+  sums = _mm_add_epi32(sums,_mm_madd_epi16(a,one));
+  lows = _mm_min_epi16(lows,a);
+  highs = _mm_max_epi16(highs,a);
+ }
+ kcs_level_reduce(sums,lows,highs,sum,low,high);
+ kcs_level_scalar(data + x,data_length - x,sum,low,high);
+}
+
+__attribute__((target("sse2")))
+static void kcs_gain_sse2(
+ const int16_t *data,
+ unsigned data_length,
+ int16_t center,
+ int16_t gain,
+ int16_t *out
+){
+ /* 32-bit products from the low and high halves, shifted and packed
+    back down with saturation */
+ const __m128i c = _mm_set1_epi16(center),g = _mm_set1_epi16(gain);
+ __m128i a,lo,hi;
+ unsigned x;
+ 
+ for(x = 0;x + 8 <= data_length;x += 8){
+  a = _mm_subs_epi16(_mm_loadu_si128((const __m128i *)(data + x)),c);
+  lo = _mm_mullo_epi16(a,g);
+  hi = _mm_mulhi_epi16(a,g);
+  _mm_storeu_si128((__m128i *)(out + x),_mm_packs_epi32(
+   _mm_srai_epi32(_mm_unpacklo_epi16(lo,hi),8),
+   _mm_srai_epi32(_mm_unpackhi_epi16(lo,hi),8)));
+ }
+ kcs_gain_scalar(data + x,data_length - x,center,gain,out + x);
+}
+
+__attribute__((target("avx2")))
+static void kcs_level_avx2(
+ const int16_t *data,
+ unsigned data_length,
+ int32_t *sum,
+ int16_t *low,
+ int16_t *high
+){
+ const __m256i one = _mm256_set1_epi16(1);
+ __m256i a,sums = _mm256_setzero_si256();
+ __m256i lows = _mm256_set1_epi16(*low),highs = _mm256_set1_epi16(*high);
+ unsigned x;
+ 
+ for(x = 0;x + 16 <= data_length;x += 16){
+  a = _mm256_loadu_si256((const __m256i *)(data + x));
+  sums = _mm256_add_epi32(sums,_mm256_madd_epi16(a,one));
+  lows = _mm256_min_epi16(lows,a);
+  highs = _mm256_max_epi16(highs,a);
+ }
+ kcs_level_reduce(
+  _mm_add_epi32(_mm256_castsi256_si128(sums),
+   _mm256_extracti128_si256(sums,1)),
+  _mm_min_epi16(_mm256_castsi256_si128(lows),
+   _mm256_extracti128_si256(lows,1)),
+  _mm_max_epi16(_mm256_castsi256_si128(highs),
+   _mm256_extracti128_si256(highs,1)),
+  sum,low,high);
+ _mm256_zeroupper();
+ kcs_level_scalar(data + x,data_length - x,sum,low,high);
+}
+
+__attribute__((target("avx2")))
+static void kcs_gain_avx2(
+ const int16_t *data,
+ unsigned data_length,
+ int16_t center,
+ int16_t gain,
+ int16_t *out
+){
+ /* unpack and packs both work within 128-bit lanes, so the samples come
+    out in order */
+ const __m256i c = _mm256_set1_epi16(center),g = _mm256_set1_epi16(gain);
+ __m256i a,lo,hi;
+ unsigned x;
+ 
+ for(x = 0;x + 16 <= data_length;x += 16){
+  a = _mm256_subs_epi16(_mm256_loadu_si256((const __m256i *)(data + x)),c);
+  lo = _mm256_mullo_epi16(a,g);
+  hi = _mm256_mulhi_epi16(a,g);
+  _mm256_storeu_si256((__m256i *)(out + x),_mm256_packs_epi32(
+   _mm256_srai_epi32(_mm256_unpacklo_epi16(lo,hi),8),
+   _mm256_srai_epi32(_mm256_unpackhi_epi16(lo,hi),8)));
+ }
+ _mm256_zeroupper();
+ kcs_gain_sse2(data + x,data_length - x,center,gain,out + x);
+}
+#endif
+
+/* === REED-SOLOMON REMAINDER ===
+   Reed-Solomon parity is the message shifted up by KCS_FEC_PARITY symbols
+   modulo the generator polynomial, over GF(256). As a shift register,
+   each byte moves the remainder along a symbol and adds in the generator
+   scaled by the symbol that fell out. kcs_rs_table holds the generator
+   scaled by every byte value, so a step is one shift and one table row,
+   and the 32 symbols fit two SSE2 registers or one AVX2 register. Run over
+   a whole codeword, the register ends up zero if nothing was damaged. */
+typedef void (*remainder_function)(const unsigned char *,unsigned,
+ unsigned char *);
+
+/* Row f, symbol y: f times the generator coefficient of x^(31 - y) */
+static unsigned char kcs_rs_table[256][KCS_FEC_PARITY]
+ __attribute__((aligned(32)));
+
+static void kcs_remainder_scalar(
+ const unsigned char *data,
+ unsigned data_length,
+ unsigned char *rem /* Highest power first, carried in and out */
+){
+ const unsigned char *row;
+ unsigned x,y;
+ 
+ for(x = 0;x < data_length;x++){
+  row = kcs_rs_table[data[x] ^ rem[0]];
+  for(y = 0;y < KCS_FEC_PARITY - 1;y++)
+   rem[y] = rem[y + 1] ^ row[y];
+  rem[y] = row[y];
+ }
+}
+
+#ifdef KCS_X86
+__attribute__((target("sse2")))
+static void kcs_remainder_sse2(
+ const unsigned char *data,
+ unsigned data_length,
+ unsigned char *rem
+){
+ __m128i lo = _mm_loadu_si128((const __m128i *)rem);
+ __m128i hi = _mm_loadu_si128((const __m128i *)(rem + 16));
+ const __m128i *row;
+ unsigned x;
+ 
+ for(x = 0;x < data_length;x++){
+  row = (const __m128i *)kcs_rs_table[
+   (data[x] ^ _mm_cvtsi128_si32(lo)) & 0xFF];
+  lo = _mm_xor_si128(_mm_or_si128(_mm_srli_si128(lo,1),
+   _mm_slli_si128(hi,15)),_mm_load_si128(row));
+  hi = _mm_xor_si128(_mm_srli_si128(hi,1),_mm_load_si128(row + 1));
+ }
+ _mm_storeu_si128((__m128i *)rem,lo);
+ _mm_storeu_si128((__m128i *)(rem + 16),hi);
+}
+
+__attribute__((target("avx2")))
+static void kcs_remainder_avx2(
+ const unsigned char *data,
+ unsigned data_length,
+ unsigned char *rem
+){
+ __m256i r = _mm256_loadu_si256((const __m256i *)rem);
+ unsigned x;
+ 
+ /* alignr shifts within 128-bit lanes, so the permute supplies the byte
+    that crosses from the upper lane into the lower */
+ for(x = 0;x < data_length;x++)
+  r = _mm256_xor_si256(
+   _mm256_alignr_epi8(_mm256_permute2x128_si256(r,r,0x81),r,1),
+   _mm256_load_si256((const __m256i *)kcs_rs_table[
+    (data[x] ^ _mm256_cvtsi256_si32(r)) & 0xFF]));
+ _mm256_storeu_si256((__m256i *)rem,r);
+ _mm256_zeroupper();
+}
+#endif
+
+/* === TONE SYNTHESIS ===
+   Writes length samples of a tone from the wavetable, from phase on and
+   stepping by step a sample; the top KCS_WAVE_BITS of the phase index the
+   table. The AVX2 kernel gathers eight samples at once as 32-bit loads,
+   each taking its sample and the next, which is why the table repeats
+   its first sample at the end. */
+#define KCS_TONE_VECTOR 16 /* Samples the AVX2 kernel writes a loop */
+
+typedef void (*tone_function)(const int16_t *,uint32_t,uint32_t,unsigned,
+ int16_t *);
+
+static void kcs_tone_scalar(
+ const int16_t *table,
+ uint32_t phase,
+ uint32_t step,
+ unsigned length,
+ int16_t *data
+){
+ unsigned x;
+ 
+ for(x = 0;x < length;x++,phase += step)
+  data[x] = table[phase >> (32 - KCS_WAVE_BITS)];
+}
+
+#ifdef KCS_X86
+__attribute__((target("avx2")))
+static void kcs_tone_avx2(
+ const int16_t *table,
+ uint32_t phase,
+ uint32_t step,
+ unsigned length,
+ int16_t *data
+){
+ __m256i lo = _mm256_add_epi32(_mm256_set1_epi32(phase),_mm256_mullo_epi32(
+  _mm256_set1_epi32(step),_mm256_setr_epi32(0,1,2,3,4,5,6,7)));
+ __m256i hi = _mm256_add_epi32(lo,_mm256_set1_epi32(step * 8));
+ __m256i stride = _mm256_set1_epi32(step * 16);
+ __m256i a,b;
+ unsigned x;
+ 
+ for(x = 0;x + KCS_TONE_VECTOR <= length;x += KCS_TONE_VECTOR){
+  a = _mm256_i32gather_epi32((const int *)table,
+   _mm256_srli_epi32(lo,32 - KCS_WAVE_BITS),2);
+  b = _mm256_i32gather_epi32((const int *)table,
+   _mm256_srli_epi32(hi,32 - KCS_WAVE_BITS),2);
+  /* The low half of each load is the sample; packing works within
+     lanes, so the permute puts the quarters back in order */
+  a = _mm256_srai_epi32(_mm256_slli_epi32(a,16),16);
+  b = _mm256_srai_epi32(_mm256_slli_epi32(b,16),16);
+  _mm256_storeu_si256((__m256i *)(data + x),
+   _mm256_permute4x64_epi64(_mm256_packs_epi32(a,b),0xD8));
+  lo = _mm256_add_epi32(lo,stride);
+  hi = _mm256_add_epi32(hi,stride);
+ }
+ _mm256_zeroupper();
+ kcs_tone_scalar(table,phase + x * step,step,length - x,data + x);
+}
+#endif
+
+/* === DECIMATION ===
+   The anti-alias filter of the decoder's front end, run only at the
+   samples it keeps: output x is the Q15 taps' dot product with the
+   tap_count samples from data[x * factor] on, rounded and saturated.
+   tap_count is a whole number of AVX2 vectors. The vector kernels take
+   several outputs a loop and reduce their sums together. */
+typedef void (*decimate_function)(const int16_t *,unsigned,unsigned,
+ const int16_t *,unsigned,int16_t *);
+
+static void kcs_decimate_scalar(
+ const int16_t *data,
+ unsigned out_length,
+ unsigned factor,
+ const int16_t *taps,
+ unsigned tap_count,
+ int16_t *out
+){
+ int32_t sum;
+ unsigned x,y;
+ 
+ for(x = 0;x < out_length;x++,data += factor){
+  sum = 1 << 14;
+  for(y = 0;y < tap_count;y++)
+   sum += taps[y] * data[y];
+  out[x] = max(INT16_MIN,min(INT16_MAX,sum >> 15));
+ }
+}
+
+#ifdef KCS_X86
+__attribute__((target("sse2")))
+static void kcs_decimate_sse2(
+ const int16_t *data,
+ unsigned out_length,
+ unsigned factor,
+ const int16_t *taps,
+ unsigned tap_count,
+ int16_t *out
+){
+ __m128i s0,s1,s2,s3,t;
+ unsigned x,y;
+ 
+ for(x = 0;x + 4 <= out_length;x += 4,data += factor * 4){
+  s0 = s1 = s2 = s3 = _mm_setzero_si128();
+  for(y = 0;y < tap_count;y += 8){
+   t = _mm_loadu_si128((const __m128i *)(taps + y));
+   s0 = _mm_add_epi32(s0,_mm_madd_epi16(t,
+    _mm_loadu_si128((const __m128i *)(data + y))));
+   s1 = _mm_add_epi32(s1,_mm_madd_epi16(t,
+    _mm_loadu_si128((const __m128i *)(data + factor + y))));
+   s2 = _mm_add_epi32(s2,_mm_madd_epi16(t,
+    _mm_loadu_si128((const __m128i *)(data + factor * 2 + y))));
+   s3 = _mm_add_epi32(s3,_mm_madd_epi16(t,
+    _mm_loadu_si128((const __m128i *)(data + factor * 3 + y))));
+  }
+  /* Transposed, so that adding the rows leaves one sum a lane */
+  s0 = _mm_add_epi32(_mm_unpacklo_epi32(s0,s1),_mm_unpackhi_epi32(s0,s1));
+  s2 = _mm_add_epi32(_mm_unpacklo_epi32(s2,s3),_mm_unpackhi_epi32(s2,s3));
+  t = _mm_add_epi32(_mm_unpacklo_epi64(s0,s2),_mm_unpackhi_epi64(s0,s2));
+  t = _mm_srai_epi32(_mm_add_epi32(t,_mm_set1_epi32(1 << 14)),15);
+  _mm_storel_epi64((__m128i *)(out + x),_mm_packs_epi32(t,t));
+ }
+ kcs_decimate_scalar(data,out_length - x,factor,taps,tap_count,out + x);
+}
+
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) __m256i kcs_decimate_quad(
+ const int16_t *data,
+ unsigned factor,
+ const int16_t *taps,
+ unsigned tap_count
+){
+ /* Four outputs' sums, each lane half holding a half sum of each in
+    order */
+ __m256i s0 = _mm256_setzero_si256(),s1 = s0,s2 = s0,s3 = s0,t;
+ unsigned y;
+ 
+ for(y = 0;y < tap_count;y += 16){
+  t = _mm256_loadu_si256((const __m256i *)(taps + y));
+  s0 = _mm256_add_epi32(s0,_mm256_madd_epi16(t,
+   _mm256_loadu_si256((const __m256i *)(data + y))));
+  s1 = _mm256_add_epi32(s1,_mm256_madd_epi16(t,
+   _mm256_loadu_si256((const __m256i *)(data + factor + y))));
+  s2 = _mm256_add_epi32(s2,_mm256_madd_epi16(t,
+   _mm256_loadu_si256((const __m256i *)(data + factor * 2 + y))));
+  s3 = _mm256_add_epi32(s3,_mm256_madd_epi16(t,
+   _mm256_loadu_si256((const __m256i *)(data + factor * 3 + y))));
+ }
+ return _mm256_hadd_epi32(_mm256_hadd_epi32(s0,s1),_mm256_hadd_epi32(s2,s3));
+}
+
+__attribute__((target("avx2")))
+static void kcs_decimate_avx2(
+ const int16_t *data,
+ unsigned out_length,
+ unsigned factor,
+ const int16_t *taps,
+ unsigned tap_count,
+ int16_t *out
+){
+ __m256i a,b;
+ unsigned x;
+ 
+ for(x = 0;x + 8 <= out_length;x += 8,data += factor * 8){
+  a = kcs_decimate_quad(data,factor,taps,tap_count);
+  b = kcs_decimate_quad(data + factor * 4,factor,taps,tap_count);
+  /* The permutes line up the two half sums of each output */
+  a = _mm256_add_epi32(_mm256_permute2x128_si256(a,b,0x20),
+   _mm256_permute2x128_si256(a,b,0x31));
+  a = _mm256_srai_epi32(_mm256_add_epi32(a,_mm256_set1_epi32(1 << 14)),15);
+  _mm_storeu_si128((__m128i *)(out + x),_mm_packs_epi32(
+   _mm256_castsi256_si128(a),_mm256_extracti128_si256(a,1)));
+ }
+ _mm256_zeroupper();
+ kcs_decimate_scalar(data,out_length - x,factor,taps,tap_count,out + x);
+}
+#endif
+
+static scan_function kcs_scan = NULL;
+static correlate_function kcs_correlate = NULL;
+static widen_function kcs_widen_kernel = NULL;
+static level_function kcs_level = NULL;
+static gain_function kcs_gain = NULL;
+static remainder_function kcs_remainder = NULL;
+static tone_function kcs_tone = NULL;
+static decimate_function kcs_decimate = NULL;
+static pthread_once_t kcs_kernel_once = PTHREAD_ONCE_INIT;
+
+static void kcs_kernel_select(void){
+ kcs_scan = kcs_scan_scalar;
+ kcs_correlate = kcs_correlate_scalar;
+ kcs_widen_kernel = kcs_widen_scalar;
+ kcs_level = kcs_level_scalar;
+ kcs_gain = kcs_gain_scalar;
+ kcs_remainder = kcs_remainder_scalar;
+ kcs_tone = kcs_tone_scalar;
+ kcs_decimate = kcs_decimate_scalar;
+#ifdef KCS_X86
+ __builtin_cpu_init();
+ if(__builtin_cpu_supports("avx2")){
+  kcs_scan = kcs_scan_avx2;
+  kcs_correlate = kcs_correlate_avx2;
+  kcs_widen_kernel = kcs_widen_avx2;
+  kcs_level = kcs_level_avx2;
+  kcs_gain = kcs_gain_avx2;
+  kcs_remainder = kcs_remainder_avx2;
+  kcs_tone = kcs_tone_avx2;
+  kcs_decimate = kcs_decimate_avx2;
+ }else if(__builtin_cpu_supports("sse2")){
+  kcs_scan = kcs_scan_sse2;
+  kcs_correlate = kcs_correlate_sse2;
+  kcs_widen_kernel = kcs_widen_sse2;
+  kcs_level = kcs_level_sse2;
+  kcs_gain = kcs_gain_sse2;
+  kcs_remainder = kcs_remainder_sse2;
+  kcs_decimate = kcs_decimate_sse2;
+ }
+#endif
+}
+
+void kcs_widen(const int16_t *src,int32_t *dst,size_t length){
+ pthread_once(&kcs_kernel_once,kcs_kernel_select);
+ kcs_widen_kernel(src,dst,length);
+}
+
+/* === BYTE SYNTHESIS ===
+   A byte is a zero start bit, eight data bits from the lowest, after a
+   newline the null pulse, and two ones stop bits, played as runs of a
+   tone. A run ends exactly where its bits do, so the samples falling in
+   it are counted from the stream's offset, and its tone starts at the
+   phase it has reached by the first of them. Bits are whole cycles, so
+   both tones meet at the same phase at every boundary. */
+
+static unsigned kcs_byte_runs(
+ const struct kcs_encoder *enc,
+ unsigned char c,
+ unsigned char *tone,
+ uint64_t *time
+){
+ /* Splits a byte into runs of a tone, returning how many */
+ unsigned x,bit,runs = 0;
+ uint64_t length;
+ 
+ for(x = 0;x < 11;x++){
+  bit = (x == 0)?0:(x < 9)?(c >> (x - 1)) & 1:1;
+  length = enc->bit_time[bit];
+  if(x == 9 && c == '\n')
+   length += enc->null_time;
+  if(runs && tone[runs - 1] == bit)
+   time[runs - 1] += length;
+  else{
+   tone[runs] = bit;
+   time[runs++] = length;
+  }
+ }
+ return runs;
+}
+
+static unsigned kcs_run_length(uint32_t *offset,uint64_t time){
+ /* Samples in a run of time from *offset on, moving *offset past its
+    end */
+ uint64_t length = (time > *offset)?(time - *offset + UINT32_MAX) >> 32:0;
+ 
+ *offset = *offset + (length << 32) - time;
+ return length;
+}
+
+static unsigned kcs_vectors(unsigned length){
+ /* Rounds up to whole vectors of the tone kernels */
+ return (length + KCS_TONE_VECTOR - 1) / KCS_TONE_VECTOR * KCS_TONE_VECTOR;
+}
+
+static unsigned kcs_encode_run(
+ const struct kcs_encoder *enc,
+ struct kcs_encode_state *state,
+ int tone,
+ uint64_t time,
+ int16_t *data,
+ int32_t *data32, /* Written instead when data is NULL */
+ unsigned room /* Samples data can take */
+){
+ /* Runs are mostly a few vectors long, so where there is room the whole
+    of the last vector is written too, for the runs after to write over,
+    rather than finishing sample by sample */
+ uint32_t step = enc->step[tone];
+ uint32_t phase = ((uint64_t)state->offset * step) >> 32;
+ unsigned length = kcs_run_length(&state->offset,time);
+ int16_t chunk[256];
+ unsigned x,chunk_length;
+ 
+ if(data != NULL){
+  kcs_tone(enc->wave_table,phase,step,
+   (kcs_vectors(length) <= room)?kcs_vectors(length):length,data);
+  return length;
+ }
+ for(x = 0;x < length;x += chunk_length){
+  chunk_length = min(length - x,256);
+  kcs_tone(enc->wave_table,phase + x * step,step,kcs_vectors(chunk_length),
+   chunk);
+  kcs_widen_kernel(chunk,data32 + x,chunk_length);
+ }
+ return length;
+}
+
+static unsigned kcs_encode_bytes(
+ const struct kcs_encoder *enc,
+ struct kcs_encode_state *state,
+ const char *block,
+ unsigned block_length,
+ int16_t *data,
+ int32_t *data32
+){
+ unsigned char tone[KCS_BYTE_RUNS];
+ uint64_t time[KCS_BYTE_RUNS];
+ unsigned length = kcs_encode_block_length(enc,state,block,block_length);
+ unsigned x,y,runs,pos = 0;
+ 
+ pthread_once(&kcs_kernel_once,kcs_kernel_select);
+ for(y = 0;y < block_length;y++){
+  runs = kcs_byte_runs(enc,block[y],tone,time);
+  for(x = 0;x < runs;x++)
+   pos += kcs_encode_run(enc,state,tone[x],time[x],
+    data?data + pos:NULL,data?NULL:data32 + pos,length - pos);
+ }
+ return pos;
+}
+
+static uint64_t kcs_carrier_time(
+ const struct kcs_encoder *enc,
+ unsigned seconds
+){
+ /* Seconds of the ones tone, which are whole cycles of it */
+ return (uint64_t)seconds * enc->params.framerate << 32;
+}
+
+int16_t *kcs_encode_carrier(
+ const struct kcs_encoder *enc,
+ struct kcs_encode_state *state,
+ unsigned seconds,
+ unsigned *length
+){
+ uint64_t time = kcs_carrier_time(enc,seconds);
+ uint32_t offset = state->offset;
+ int16_t *data;
+ 
+ pthread_once(&kcs_kernel_once,kcs_kernel_select);
+ if((data = malloc(max(kcs_run_length(&offset,time),1) * sizeof(*data))) ==
+  NULL)
+  return NULL;
+ *length = kcs_encode_run(enc,state,1,time,data,NULL,0);
+ return data;
+}
+
+static uint64_t kcs_block_time(
+ const struct kcs_encoder *enc,
+ const char *block,
+ unsigned block_length
+){
+ uint64_t time = 0;
+ unsigned y,ones;
+ unsigned char c;
+ 
+ for(y = 0;y < block_length;y++){
+  c = block[y];
+  ones = __builtin_popcount(c) + 2; /* With the stop bits */
+  time += ones * enc->bit_time[1] + (11 - ones) * enc->bit_time[0];
+  if(c == '\n')
+   time += enc->null_time;
+ }
+ return time;
+}
+
+unsigned kcs_encode_block_length(
+ const struct kcs_encoder *enc,
+ const struct kcs_encode_state *state,
+ const char *block,
+ unsigned block_length
+){
+ /* The runs of the block tile its time, so the samples in them are the
+    samples in the whole */
+ uint32_t offset = state->offset;
+ 
+ return kcs_run_length(&offset,kcs_block_time(enc,block,block_length));
+}
+
+unsigned kcs_encode_block_into(
+ const struct kcs_encoder *enc,
+ struct kcs_encode_state *state,
+ const char *block,
+ unsigned block_length,
+ int16_t *data
+){
+ return kcs_encode_bytes(enc,state,block,block_length,data,NULL);
+}
+
+unsigned kcs_encode_block_into32(
+ const struct kcs_encoder *enc,
+ struct kcs_encode_state *state,
+ const char *block,
+ unsigned block_length,
+ int32_t *data
+){
+ /* As kcs_encode_block_into(), widening the samples straight into data */
+ return kcs_encode_bytes(enc,state,block,block_length,NULL,data);
+}
+
+int16_t *kcs_encode_block(
+ const struct kcs_encoder *enc,
+ struct kcs_encode_state *state,
+ const char *block,
+ unsigned block_length,
+ unsigned *length
+){
+ int16_t *data;
+ unsigned data_length;
+ 
+ data_length = kcs_encode_block_length(enc,state,block,block_length);
+ if((data = malloc(max(data_length,1) * sizeof(*data))) == NULL)
+  return NULL;
+ *length = kcs_encode_block_into(enc,state,block,block_length,data);
+ return data;
+}
+
+/* === STREAMING ENCODER ===
+   kcs_encoder_feed() only queues the bytes and counts the samples they
+   come to. kcs_encoder_pull() synthesises them a run at a time, stopping
+   part way through one when the caller's buffer is full and going on
+   from the phase it reached on the next call. The leader and trailer are
+   runs of their own and a null pulse is part of its newline's last run,
+   so none of them is ever held whole. */
+
+static void kcs_encoder_carrier(struct kcs_encoder *enc,unsigned seconds){
+ /* Makes the carrier the only run left to synthesise */
+ enc->tone[0] = 1;
+ enc->time[0] = kcs_carrier_time(enc,seconds);
+ enc->run = 0;
+ enc->runs = 1;
+}
+
+static unsigned kcs_encoder_runs(struct kcs_encoder *enc){
+ /* Splits the next byte queued, or once they are done the trailer, into
+    runs, returning how many */
+ if(enc->queue_length){
+  enc->runs = kcs_byte_runs(enc,enc->queue[enc->queue_start++],enc->tone,
+   enc->time);
+  enc->run = 0;
+  if(--enc->queue_length == 0)
+   enc->queue_start = 0;
+ }else if(enc->finished == 1){
+  kcs_encoder_carrier(enc,enc->params.trailer);
+  enc->finished = 2;
+ }else
+  return 0;
+ return enc->runs;
+}
+
+int kcs_encoder_feed(struct kcs_encoder *enc,const char *bytes,size_t length){
+ /* Queues length bytes, after the leader on the first call */
+ size_t x,block_length;
+ 
+ if(!enc->started){
+  kcs_encoder_carrier(enc,enc->params.leader);
+  enc->length += kcs_run_length(&enc->end.offset,enc->time[0]);
+  enc->started = 1;
+ }
+ 
+ if(length == 0)
+  return 0;
+ if(kcs_queue_reserve((void **)&enc->queue,&enc->queue_start,
+  enc->queue_length,&enc->queue_capacity,length,sizeof(*enc->queue)) < 0)
+  return -1;
+ memcpy(enc->queue + enc->queue_start + enc->queue_length,bytes,length);
+ enc->queue_length += length;
+ /* In pieces whose time cannot overflow */
+ for(x = 0;x < length;x += block_length){
+  block_length = (length - x < 65536)?length - x:65536;
+  enc->length += kcs_run_length(&enc->end.offset,
+   kcs_block_time(enc,bytes + x,block_length));
+ }
+ return 0;
+}
+
+int kcs_encoder_finish(struct kcs_encoder *enc){
+ /* Queues the trailer */
+ if(kcs_encoder_feed(enc,NULL,0) < 0)
+  return -1;
+ if(!enc->finished){
+  enc->length += kcs_run_length(&enc->end.offset,
+   kcs_carrier_time(enc,enc->params.trailer));
+  enc->finished = 1;
+ }
+ return 0;
+}
+
+size_t kcs_encoder_pull(struct kcs_encoder *enc,int16_t *samples,size_t max){
+ /* Like kcs_encode_run(), writes whole vectors where there is room */
+ size_t pos = 0;
+ unsigned length;
+ uint32_t step;
+ 
+ pthread_once(&kcs_kernel_once,kcs_kernel_select);
+ while(pos < max){
+  if(enc->left == 0){
+   if(enc->run == enc->runs && kcs_encoder_runs(enc) == 0)
+    break;
+   step = enc->step[enc->tone[enc->run]];
+   enc->phase = ((uint64_t)enc->state.offset * step) >> 32;
+   enc->left = kcs_run_length(&enc->state.offset,enc->time[enc->run++]);
+   continue;
+  }
+  step = enc->step[enc->tone[enc->run - 1]];
+  length = (enc->left < max - pos)?enc->left:max - pos;
+  kcs_tone(enc->wave_table,enc->phase,step,
+   (kcs_vectors(length) <= max - pos)?kcs_vectors(length):length,
+   samples + pos);
+  enc->phase += length * step;
+  enc->left -= length;
+  pos += length;
+ }
+ enc->length -= pos;
+ return pos;
+}
+
+static unsigned kcs_next_bit(
+ const uint64_t *mask,
+ unsigned data_length,
+ unsigned pos
+){
+ /* Index of the first set bit at or after pos, or data_length */
+ unsigned w = pos / 64;
+ uint64_t bits;
+ 
+ if(pos >= data_length)
+  return data_length;
+ bits = mask[w] & (~(uint64_t)0 << (pos % 64));
+ while(bits == 0){
+  if(++w * 64 >= data_length)
+   return data_length;
+  bits = mask[w];
+ }
+ return min(w * 64 + __builtin_ctzll(bits),data_length);
+}
+
+static unsigned kcs_next_cross(
+ const uint64_t *neg,
+ unsigned data_length,
+ unsigned pos
+){
+ /* Index of the first falling zero cross at or after pos, or data_length */
+ unsigned w = pos / 64;
+ uint64_t bits;
+ 
+ if(pos >= data_length)
+  return data_length;
+ bits = neg[w] & ~((neg[w] << 1) | (w?neg[w - 1] >> 63:0));
+ bits &= ~(uint64_t)0 << (pos % 64);
+ while(bits == 0){
+  if(++w * 64 >= data_length)
+   return data_length;
+  bits = neg[w] & ~((neg[w] << 1) | (neg[w - 1] >> 63));
+ }
+ return min(w * 64 + __builtin_ctzll(bits),data_length);
+}
+
+
+void kcs_decoder_free(struct kcs_decoder *dec){
+ free(dec->taps);
+ free(dec->input);
+ free(dec->resampled);
+ free(dec->cycle_class);
+ free(dec->cyclefreq);
+ free(dec->cyclefreq_end);
+ free(dec->text);
+ free(dec->text_pos);
+ free(dec->neg_mask);
+ free(dec->loud_mask);
+ free(dec->reference);
+ free(dec->correlation);
+ free(dec->label);
+ free(dec->samples);
+ free(dec->chunk);
+ free(dec->window);
+ free(dec->queue);
+ memset(dec,0,sizeof(*dec));
+}
+
+static int kcs_resize(void **array,size_t length,size_t size){
+ /* Grows an array, keeping what it holds */
+ void *resized;
+ 
+ if((resized = realloc(*array,length * size + 1)) == NULL)
+  return -1;
+ *array = resized;
+ return 0;
+}
+
+static int kcs_decoder_scratch(struct kcs_decoder *dec,unsigned block_length){
+ /* Grows the per-block arrays for blocks of block_length samples fed,
+    which with the filter's flush resample to at most length. They keep
+    their contents, as the stream carries over at their fronts: the
+    demodulator's history in samples and the pending cycles. A block
+    demodulates with the history and any AGC chunk left from the last one.
+    Every cycle spans at least two samples at the nominal clock, and 1.6
+    at the fastest; every byte many cycles; every hop four samples. */
+ unsigned length = (block_length + dec->tap_count) * dec->up / dec->factor + 2;
+ unsigned span = length + dec->chunk_capacity + dec->history_capacity;
+ unsigned cycles = span / 8 * 5 + dec->frame_cycles + 2;
+ unsigned words = span / 64 + 1;
+ unsigned hops = span / 4 + 1;
+ 
+ if(
+  kcs_resize((void **)&dec->cyclefreq,cycles,sizeof(*dec->cyclefreq)) < 0 ||
+  kcs_resize((void **)&dec->cyclefreq_end,cycles,
+   sizeof(*dec->cyclefreq_end)) < 0 ||
+  kcs_resize((void **)&dec->text,cycles,sizeof(*dec->text)) < 0 ||
+  kcs_resize((void **)&dec->text_pos,cycles,sizeof(*dec->text_pos)) < 0 ||
+  kcs_resize((void **)&dec->neg_mask,words,sizeof(*dec->neg_mask)) < 0 ||
+  kcs_resize((void **)&dec->loud_mask,words,sizeof(*dec->loud_mask)) < 0 ||
+  kcs_resize((void **)&dec->correlation,hops * 4,
+   sizeof(*dec->correlation)) < 0 ||
+  kcs_resize((void **)&dec->label,hops,sizeof(*dec->label)) < 0 ||
+  kcs_resize((void **)&dec->samples,span,sizeof(*dec->samples)) < 0
+ )
+  return -1;
+ if(dec->tap_count &&
+  kcs_resize((void **)&dec->resampled,length,sizeof(*dec->resampled)) < 0)
+  return -1;
+ dec->capacity = block_length;
+ return 0;
+}
+
+static unsigned kcs_gcd(unsigned x,unsigned y){
+ unsigned z;
+ 
+ while(y){
+  z = x % y;
+  x = y;
+  y = z;
+ }
+ return x;
+}
+
+static int kcs_decoder_references(struct kcs_decoder *dec){
+ /* The correlator's references, see kcs_correlate */
+ const struct kcs_params *params = &dec->params;
+ /* Both tones repeat exactly after this many samples */
+ unsigned period = params->framerate / kcs_gcd(params->framerate,
+  kcs_gcd(params->ones_freq,params->zero_freq));
+ unsigned x,y;
+ double phase;
+ 
+ /* Whole pairs of sample pairs */
+ period *= 4 / kcs_gcd(period,4);
+ 
+ dec->reference = malloc(period * 4 * sizeof(*dec->reference));
+ dec->reference_length = period / 2;
+ if(dec->reference == NULL)
+  return -1;
+ for(x = 0;x < period;x++){
+  for(y = 0;y < 4;y++){
+   phase = 2 * M_PI * x *
+    ((y < 2)?params->ones_freq:params->zero_freq) / params->framerate;
+   dec->reference[x / 2 * 8 + y * 2 + x % 2] =
+    round(((y & 1)?sin(phase):cos(phase)) * 16384);
+  }
+ }
+ return 0;
+}
+
+#define KCS_CYCLE_NONE 2
+#define KCS_CLASS_STEPS 16 /* Table entries per sample of distance */
+
+static int kcs_decoder_classes(struct kcs_decoder *dec){
+ /* Tabulates the tone of every zero cross distance, in sixteenths of a
+    sample, so that the zero cross demodulator does one lookup per cycle:
+    the nearer tone's, if the distance lies within a quarter of the gap
+    between the two periods of either. Other distances are
+    KCS_CYCLE_NONE. Distances are looked up after dividing out the
+    tracked clock, so the table holds the nominal periods. */
+ const struct kcs_params *params = &dec->params;
+ double ones_length = (double)params->framerate / params->ones_freq;
+ double zero_length = (double)params->framerate / params->zero_freq;
+ double tolerance = fabs(ones_length - zero_length) / 4;
+ double distance;
+ unsigned x;
+ 
+ dec->cycle_class_length =
+  (fmax(ones_length,zero_length) + tolerance) * KCS_CLASS_STEPS + 1;
+ dec->cycle_class = malloc(dec->cycle_class_length);
+ if(dec->cycle_class == NULL)
+  return -1;
+ for(x = 0;x < dec->cycle_class_length;x++){
+  distance = (double)x / KCS_CLASS_STEPS;
+  if(distance < fmin(ones_length,zero_length) - tolerance)
+   dec->cycle_class[x] = KCS_CYCLE_NONE;
+  else
+   dec->cycle_class[x] =
+    fabs(distance - ones_length) < fabs(distance - zero_length);
+ }
+ return 0;
+}
+
+#define KCS_DECIMATE_BETA 3.0 /* Kaiser window shape */
+
+static double kcs_bessel_i0(double x){
+ /* Modified Bessel function of the first kind, order zero, by its
+    series, for the Kaiser window */
+ double term = 1,sum = 1;
+ unsigned k;
+ 
+ for(k = 1;term > sum * 1e-12;k++){
+  term *= x * x / (4.0 * k * k);
+  sum += term;
+ }
+ return sum;
+}
+
+static int kcs_decoder_taps(struct kcs_decoder *dec){
+ /* The anti-alias filter, see kcs_decimate_block: a sinc cut off at the
+    internal Nyquist frequency under a Kaiser window, scaled to unit
+    gain. Only what would fold back onto the tones, from the internal
+    rate less the higher tone up, has to be stopped, which the window
+    does by about 45 dB. Interpolating, it is cut off at the Nyquist
+    frequency of the samples fed instead, and its taps are Q14 with a
+    gain of up, which the samples it fills in with zeros take back. */
+ unsigned count = dec->tap_count;
+ unsigned keep = count / dec->up - 1;
+ double scale = (dec->up > 1)?16384.0 * dec->up:32768.0;
+ double center = (count - 1) / 2.0;
+ double sum = 0,t,w;
+ double *tap;
+ unsigned x;
+ 
+ if((tap = malloc(count * sizeof(*tap))) == NULL)
+  return -1;
+ for(x = 0;x < count;x++){
+  t = (x - center) / (dec->factor * dec->up);
+  w = (x - center) / (center + 1);
+  tap[x] = ((t == 0)?1:sin(M_PI * t) / (M_PI * t)) *
+   kcs_bessel_i0(KCS_DECIMATE_BETA * sqrt(1 - w * w));
+  sum += tap[x];
+ }
+ dec->taps = malloc(count * sizeof(*dec->taps));
+ if(dec->taps != NULL)
+  for(x = 0;x < count;x++)
+   dec->taps[x] = lround(tap[x] / sum * scale);
+ free(tap);
+ /* The history and a block's head, starting from silence */
+ dec->input = calloc(keep * 2,sizeof(*dec->input));
+ return (dec->taps != NULL && dec->input != NULL)?0:-1;
+}
+
+/* === STATISTICS ===
+   Counts and stage times go into dec->stats only when built with
+   KCS_STATS; otherwise KCS_COUNT() and KCS_LAP() compile to nothing.
+   A stopwatch is read once at each stage boundary of a block. */
+#ifdef KCS_STATS
+#define KCS_COUNT(dec,field,n) ((dec)->stats.field += (n))
+#define KCS_STOPWATCH(watch) uint64_t watch = kcs_stats_now()
+#define KCS_LAP(dec,stage,watch) kcs_stats_lap(dec,stage,&(watch))
+
+static uint64_t kcs_stats_now(void){
+ struct timespec ts;
+ 
+ clock_gettime(CLOCK_MONOTONIC,&ts);
+ return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void kcs_stats_lap(
+ struct kcs_decoder *dec,
+ unsigned stage,
+ uint64_t *watch
+){
+ uint64_t now = kcs_stats_now();
+ 
+ dec->stats.ns[stage] += now - *watch;
+ *watch = now;
+}
+#else
+#define KCS_COUNT(dec,field,n) ((void)0)
+#define KCS_STOPWATCH(watch)
+#define KCS_LAP(dec,stage,watch) ((void)0)
+#endif
+
+int kcs_stats_enabled(void){
+#ifdef KCS_STATS
+ return 1;
+#else
+ return 0;
+#endif
+}
+
+/* === CLOCK TRACKING ===
+   Tape stretch, a recorder running off speed and wow and flutter all
+   scale both tones' periods together. The decoder tracks that scale as
+   its clock, the measured period over the nominal one, with a first
+   order loop fed by each cycle (zero cross), or by each pair of short
+   runs and the carrier phase over long runs of ones (Goertzel). The first
+   updates are averaged so that it locks within a few cycles of the
+   leader, after which each update moves it by 1/KCS_CLOCK_DECAY of its
+   error. The clock carries over from one block to the next. */
+#define KCS_CLOCK_DECAY 4
+#define KCS_CLOCK_MIN 0.8
+#define KCS_CLOCK_MAX 1.25
+#define KCS_EDGE_DECAY 16 /* Runs the edge averages before it decays */
+
+static void kcs_clock_update(struct kcs_decoder *dec,double ratio){
+ if(dec->clock_count < KCS_CLOCK_DECAY)
+  dec->clock_count++;
+ dec->clock += (ratio - dec->clock) / dec->clock_count;
+ dec->clock = fmin(KCS_CLOCK_MAX,fmax(KCS_CLOCK_MIN,dec->clock));
+}
+
+static double kcs_cross_point(
+ const int16_t *data,
+ unsigned pos,
+ int16_t before
+){
+ /* Where the wave crosses zero ahead of the falling cross at pos, by
+    linear interpolation from the sample before it, which for the first
+    sample is the last of the previous block */
+ if(pos)
+  before = data[pos - 1];
+ return (double)pos - 1 + (double)before / (before - data[pos]);
+}
+
+/* === DECIMATION ===
+   Demodulating every sample of a 44.1 kHz or faster stream is wasted
+   work: the tones need only a few samples a period. The decoder keeps
+   one sample in factor, after a low-pass filter so that nothing above
+   the new Nyquist frequency folds back onto the tones. The filter runs
+   on across blocks from the last tap_count - 1 samples fed, kept at the
+   front of dec->input, and kept sample x of the stream comes from the
+   samples up to x * factor, so it stands for a time (tap_count - 1) / 2
+   samples earlier. At the end of the stream that much silence flushes
+   the filter. A 44.1 kHz stream is filtered with 16 taps, the cost of
+   about one pass over it, for a demodulator that then sees a quarter of
+   the samples. */
+#define KCS_ZEROCROSS_SAMPLES 4 /* Fewest samples a period of the higher tone */
+#define KCS_GOERTZEL_SAMPLES 16 /* Its hops need a quarter period */
+
+static unsigned kcs_decimate_block(
+ struct kcs_decoder *dec,
+ const int16_t *data, /* Or NULL for silence */
+ unsigned data_length,
+ int16_t *out
+){
+ /* Filters the block into out and returns the samples kept. Those whose
+    taps reach back past the block come from its head copied in after
+    the history, the rest from the block itself. Silence must be no
+    longer than the history. */
+ unsigned keep = dec->tap_count - 1;
+ unsigned factor = dec->factor;
+ unsigned head = min(data_length,keep);
+ unsigned out_length = 0,joined = 0;
+ 
+ if(data != NULL)
+  memcpy(dec->input + keep,data,head * sizeof(*data));
+ else
+  memset(dec->input + keep,0,head * sizeof(*data));
+ if(dec->skip < data_length)
+  out_length = (data_length - 1 - dec->skip) / factor + 1;
+ if(dec->skip < head)
+  joined = min(out_length,(head - 1 - dec->skip) / factor + 1);
+ kcs_decimate(dec->input + dec->skip,joined,factor,dec->taps,
+  dec->tap_count,out);
+ if(joined < out_length)
+  kcs_decimate(data + dec->skip + joined * factor - keep,out_length - joined,
+   factor,dec->taps,dec->tap_count,out + joined);
+ dec->skip = dec->skip + out_length * factor - data_length;
+ 
+ /* The history for the next block */
+ if(head < keep)
+  memmove(dec->input,dec->input + head,keep * sizeof(*dec->input));
+ else
+  memcpy(dec->input,data + data_length - keep,keep * sizeof(*data));
+ return out_length;
+}
+
+static unsigned kcs_interpolate_block(
+ struct kcs_decoder *dec,
+ const int16_t *data, /* Or NULL for silence */
+ unsigned data_length,
+ int16_t *out
+){
+ /* Filters the block into out at up times its rate, returning how many
+    samples that is. Fed sample x and the count - 1 before it make the
+    up samples from out[x * up] on, each through every up-th tap. Silence
+    must be no longer than the history. */
+ unsigned up = dec->up;
+ unsigned count = dec->tap_count / up;
+ unsigned keep = count - 1;
+ unsigned head = min(data_length,keep);
+ const int16_t *window;
+ int32_t sum;
+ unsigned x,y,z,out_length;
+ 
+ if(data != NULL)
+  memcpy(dec->input + keep,data,head * sizeof(*data));
+ else
+  memset(dec->input + keep,0,head * sizeof(*data));
+ for(x = 0;x < data_length;x++){
+  window = (x < keep)?dec->input + x:data + x - keep;
+  for(y = 0;y < up;y++){
+   for(sum = 1 << 13,z = 0;z < count;z++)
+    sum += dec->taps[y + (keep - z) * up] * window[z];
+   out[x * up + y] = min(INT16_MAX,max(INT16_MIN,sum >> 14));
+  }
+ }
+ 
+ if(head < keep)
+  memmove(dec->input,dec->input + head,keep * sizeof(*dec->input));
+ else
+  memcpy(dec->input,data + data_length - keep,keep * sizeof(*data));
+ out_length = data_length * up;
+ if(dec->skip){
+  x = min(dec->skip,out_length);
+  memmove(out,out + x,(out_length - x) * sizeof(*out));
+  out_length -= x;
+  dec->skip -= x;
+ }
+ return out_length;
+}
+
+static size_t kcs_input_position(const struct kcs_decoder *dec,size_t pos){
+ /* A stream position at the internal rate as one at the rate fed. The
+    filter's delay is in samples at the faster of the two. */
+ size_t delay = (dec->tap_count - 1) / 2;
+ 
+ if(dec->up > 1)
+  return pos / dec->up;
+ pos *= dec->factor;
+ return (pos > delay)?pos - delay:0;
+}
+
+/* === CONDITIONING ===
+   With automatic gain, the block is copied through a DC blocker and AGC
+   before it reaches the demodulator, so that the zero crosses are taken
+   about the signal's own centre line and the squelch is a fraction of
+   its tracked envelope rather than of full scale. Both are tracked over
+   chunks of about two periods of the lower tone: the centre follows the chunk
+   means, and the envelope jumps up to a louder chunk's peak but decays
+   over several chunks, so a fade is followed within a few bits while
+   the gaps between cycles do not pump the gain. The gain is capped so
+   that hiss on a blank stretch of tape stays under the squelch. Chunks
+   run on across blocks, the samples of an unfinished one waiting in
+   dec->chunk, so the gain does not depend on how the stream is split. */
+#define KCS_AGC_LEVEL 16384 /* Envelope the gain aims for */
+#define KCS_AGC_FLOOR 256 /* Envelope below which the gain stops rising */
+#define KCS_AGC_DECAY 8 /* Chunks for the envelope to fall most of the way */
+#define KCS_DC_DECAY 8
+
+static unsigned kcs_chunk_length(const struct kcs_params *params){
+ /* Whole vectors for the kernels */
+ return ceil(2.0 * params->framerate /
+  min(params->ones_freq,params->zero_freq) / 16) * 16;
+}
+
+static void kcs_condition_chunk(
+ struct kcs_decoder *dec,
+ const int16_t *data,
+ unsigned chunk_length,
+ int16_t *out
+){
+ int32_t sum = 0,peak;
+ int16_t low = INT16_MAX,high = INT16_MIN;
+ 
+ kcs_level(data,chunk_length,&sum,&low,&high);
+ /* Start from the first chunk's own level, then track */
+ if(dec->envelope < 0)
+  dec->center = sum / (int32_t)chunk_length;
+ else
+  dec->center += (sum / (int32_t)chunk_length - dec->center) / KCS_DC_DECAY;
+ peak = max(high - dec->center,dec->center - low);
+ if(peak > dec->envelope)
+  dec->envelope = peak;
+ else
+  dec->envelope += (peak - dec->envelope) / KCS_AGC_DECAY;
+ 
+ /* Q8 gain, at most KCS_AGC_LEVEL */
+ kcs_gain(data,chunk_length,dec->center,
+  (KCS_AGC_LEVEL << 8) / max(dec->envelope,KCS_AGC_FLOOR),out);
+}
+
+static unsigned kcs_condition(
+ struct kcs_decoder *dec,
+ const int16_t *data,
+ unsigned data_length,
+ int16_t *out,
+ int final
+){
+ /* Conditions the whole chunks of the block, after finishing the one
+    left from the last, and returns the samples written to out. At the
+    end of the stream the last chunk is conditioned however short. */
+ unsigned chunk = dec->chunk_capacity;
+ unsigned x = 0,out_length = 0,chunk_length;
+ 
+ if(dec->chunk_length){
+  x = min(chunk - dec->chunk_length,data_length);
+  memcpy(dec->chunk + dec->chunk_length,data,x * sizeof(*data));
+  dec->chunk_length += x;
+  if(dec->chunk_length < chunk && !final)
+   return 0;
+  kcs_condition_chunk(dec,dec->chunk,dec->chunk_length,out);
+  out_length = dec->chunk_length;
+  dec->chunk_length = 0;
+ }
+ for(;data_length - x >= chunk || (final && x < data_length);x += chunk_length){
+  chunk_length = min(chunk,data_length - x);
+  kcs_condition_chunk(dec,data + x,chunk_length,out + out_length);
+  out_length += chunk_length;
+ }
+ dec->chunk_length = data_length - x;
+ memcpy(dec->chunk,data + x,dec->chunk_length * sizeof(*data));
+ return out_length;
+}
+
+/* === DEMODULATORS ===
+   A demodulator turns the samples of a block into cyclefreq, one entry
+   per cycle of either tone (1 for ones_freq, 0 for zero_freq), appended
+   after the cycles still pending from the last block, and returns the
+   new number of cycles. cyclefreq_end holds the stream position of the
+   end of each cycle. Whatever a cycle or run needs from the samples of
+   earlier blocks is kept in the decoder, so no sample is demodulated
+   twice. */
+
+static unsigned kcs_cycles_zerocross(
+ struct kcs_decoder *dec,
+ const int16_t *data,
+ unsigned data_length,
+ int16_t sql_pulse,
+ int final
+){
+ /* Classifies the distance between falling zero crosses, interpolated
+    to a fraction of a sample and scaled by the tracked clock, through
+    the table kcs_decoder_classes() builds for the decoder's tones. The
+    last cross, whether any sample since it passed squelch, and the last
+    sample carry over to the next block. */
+ const struct kcs_params *params = &dec->params;
+ const unsigned char *cycle_class = dec->cycle_class;
+ unsigned cycle_class_length = dec->cycle_class_length;
+ double ones_length = (double)params->framerate / params->ones_freq;
+ double zero_length = (double)params->framerate / params->zero_freq;
+ double cross,distance;
+ unsigned index;
+ unsigned cyclefreq_length = dec->pending;
+ unsigned pos1 = 0,pos2;
+ int tone;
+ 
+ (void)final;
+ if(data_length == 0)
+  return cyclefreq_length;
+ kcs_scan(data,data_length,sql_pulse,dec->neg_mask,dec->loud_mask);
+ 
+ /* The first sample is a cross only if the last block ended above zero */
+ pos2 = kcs_next_cross(dec->neg_mask,data_length,dec->last_sample < 0);
+ 
+ while(pos2 < data_length){
+  cross = dec->position + kcs_cross_point(data,pos2,dec->last_sample);
+ 
+  /* Skip the cycle if its amplitude is not high enough */
+  dec->loud |= kcs_next_bit(dec->loud_mask,pos2,pos1) < pos2;
+ 
+  /* Append the appropriate value to cyclefreq. */
+  distance = cross - dec->cross;
+  index = distance / dec->clock * KCS_CLASS_STEPS + 0.5;
+  if(
+   dec->cross >= 0 && dec->loud &&
+   index < cycle_class_length && cycle_class[index] != KCS_CYCLE_NONE
+  ){
+   tone = cycle_class[index];
+   dec->cyclefreq_end[cyclefreq_length] = dec->position + pos2;
+   dec->cyclefreq[cyclefreq_length++] = tone;
+   kcs_clock_update(dec,distance / (tone?ones_length:zero_length));
+  }
+  KCS_COUNT(dec,crosses,1);
+  KCS_COUNT(dec,quiet,!dec->loud);
+  KCS_COUNT(dec,odd,dec->cross >= 0 && dec->loud &&
+   (index >= cycle_class_length || cycle_class[index] == KCS_CYCLE_NONE));
+  dec->cross = cross;
+  dec->loud = 0;
+  pos1 = pos2;
+ 
+  /* Seek to the next cycle of the (possible) wave */
+  pos2 = kcs_next_cross(dec->neg_mask,data_length,pos1 + 1);
+ }
+ dec->loud |= kcs_next_bit(dec->loud_mask,data_length,pos1) < data_length;
+ dec->last_sample = data[data_length - 1];
+ 
+ return cyclefreq_length;
+}
+
+static unsigned kcs_cycles_emit(
+ struct kcs_decoder *dec,
+ unsigned cyclefreq_length,
+ size_t run_end,
+ int partial
+){
+ /* Splits the run in progress, up to run_end, into cycles of its tone.
+    A whole run is rounded to whole bits, not cycles, so that the error
+    in a long run at the slower rates stays well under a bit, and its
+    cycles not yet emitted are spread over what is left of it. A run
+    still going emits only the bits that are certain by now, a partial
+    one at the end of the stream every whole cycle.
+ 
+    The labels change a little early or late depending on the tone
+    going out, by an amount that depends on the wave shape and on the
+    speed, so zero runs come out longer than they are and ones runs
+    shorter by as much, or the other way around. The decoder tracks
+    that as its edge, from what whole runs of up to four bits are left
+    over from whole bits, and takes it off every run. Like the clock, it
+    averages the first runs, so that the bytes right after the leader
+    are counted with it too. */
+ const struct kcs_params *params = &dec->params;
+ int tone = dec->run_tone;
+ double period = (double)params->framerate * dec->clock /
+  (tone?params->ones_freq:params->zero_freq);
+ unsigned bit_cycles = tone?params->ones_cycles:params->zero_cycles;
+ double length = (double)(run_end - dec->run_start) +
+  (tone?dec->edge:-dec->edge);
+ double bits = length / (period * bit_cycles);
+ unsigned cycles,x;
+ size_t pos,end;
+ 
+ if(partial > 0)
+  cycles = fmax(0,bits) * bit_cycles;
+ else if(partial < 0)
+  cycles = fmax(0,floor(bits - 0.5)) * bit_cycles;
+ else{
+  cycles = lround(fmax(0,bits)) * bit_cycles;
+  if(cycles >= bit_cycles && cycles <= bit_cycles * 4){
+   if(dec->edge_count < KCS_EDGE_DECAY)
+    dec->edge_count++;
+   dec->edge += (tone?-1:1) * (length - cycles * period) / dec->edge_count;
+  }
+ }
+ /* Cycles already emitted at the period then may reach past run_end
+    once the clock or the edge has moved, and cycle ends cannot go back */
+ run_end = (run_end > dec->run_last)?run_end:dec->run_last;
+ for(x = dec->run_cycles,pos = dec->run_last;x < cycles;x++){
+  if(partial < 0){
+   end = dec->run_start + (size_t)((x + 1) * period);
+   pos = (end < pos)?pos:(end > run_end)?run_end:end;
+  }else
+   pos = dec->run_last +
+    (run_end - dec->run_last) * (x + 1 - dec->run_cycles) /
+    (cycles - dec->run_cycles);
+  dec->cyclefreq_end[cyclefreq_length] = pos;
+  dec->cyclefreq[cyclefreq_length++] = tone;
+ }
+ if(cycles > dec->run_cycles){
+  dec->run_last = dec->cyclefreq_end[cyclefreq_length - 1];
+  dec->run_cycles = cycles;
+ }
+ return cyclefreq_length;
+}
+
+static void kcs_clock_carrier(
+ struct kcs_decoder *dec,
+ const int32_t *sums,
+ unsigned first,
+ unsigned last
+){
+ /* Measures the phase of a long ones run, labelled from hop first to
+    hop last of the block, by how far the ones correlator turns from
+    each window to the one a window length later. Run lengths cannot
+    measure the clock there, and the leader is one such run. The turns
+    add up over the run, however many blocks it spans, and reach the
+    clock in kcs_clock_turn(). sums holds a window of hops ahead of
+    first's. */
+ unsigned hops = dec->hops;
+ int64_t prev_i = 0,prev_q = 0,cur_i = 0,cur_q = 0;
+ unsigned x,y;
+ 
+ for(y = 0;y < hops;y++){
+  prev_i += sums[(first + 1 - hops * 2 + y) * 4];
+  prev_q += sums[(first + 1 - hops * 2 + y) * 4 + 1];
+  cur_i += sums[(first + 1 - hops + y) * 4];
+  cur_q += sums[(first + 1 - hops + y) * 4 + 1];
+ }
+ for(x = first;x <= last;x++){
+  if(x > first){
+   cur_i += sums[x * 4] - sums[(x - hops) * 4];
+   cur_q += sums[x * 4 + 1] - sums[(x - hops) * 4 + 1];
+   prev_i += sums[(x - hops) * 4] - sums[(x - hops * 2) * 4];
+   prev_q += sums[(x - hops) * 4 + 1] - sums[(x - hops * 2) * 4 + 1];
+  }
+  dec->carrier_re += (double)cur_i * prev_i + (double)cur_q * prev_q;
+  dec->carrier_im += (double)cur_q * prev_i - (double)cur_i * prev_q;
+ }
+ dec->carrier_count += last + 1 - first;
+}
+
+static void kcs_clock_turn(struct kcs_decoder *dec){
+ /* Moves the clock by the phase turn measured so far, if the run was
+    long enough for it to be worth anything */
+ const struct kcs_params *params = &dec->params;
+ double offset;
+ 
+ if(dec->carrier_count >= dec->hops * 3){
+  /* The sine products turn against the tone's own phase */
+  offset = -atan2(dec->carrier_im,dec->carrier_re) * params->framerate /
+   (2 * M_PI * dec->hops * dec->hop);
+  kcs_clock_update(dec,params->ones_freq / (params->ones_freq + offset));
+ }
+ dec->carrier_re = dec->carrier_im = 0;
+ dec->carrier_count = 0;
+}
+
+static unsigned kcs_cycles_goertzel(
+ struct kcs_decoder *dec,
+ const int16_t *data,
+ unsigned data_length,
+ int16_t sql_pulse,
+ int final
+){
+ /* Sliding quadrature correlators at both tones over about one period
+    of the lower tone, labelled by kcs_correlate() after every hop of
+    about a quarter period of the higher one (a multiple of four samples).
+    Each run of a label is split into cycles. A window is centred half its
+    length behind its end. data follows the last two windows and the
+    unfinished hop of the last block in dec->samples, so the correlator
+    picks up where it left off.
+ 
+    The clock is measured over each span from the start of one zero run
+    to the start of the next, made of a zero run and a ones run, so that
+    any bias in where the labels change cancels out. Runs of up to four
+    bits are counted right even 10% off speed; spans with longer runs
+    are left out, and long ones runs are measured by their phase.
+ 
+    Where the tones are about as strong, as at a change between them
+    with the harmonics of a square wave, the label can flicker for a
+    hop. A new label has to hold for a second hop to start a run, which
+    then starts at the first; the label before is kept in the history,
+    so this does not depend on where blocks split the stream. */
+ const struct kcs_params *params = &dec->params;
+ const int16_t *block = data - dec->history_length;
+ unsigned hop = dec->hop;
+ unsigned hops = dec->hops;
+ unsigned window = hops * hop;
+ unsigned block_length = dec->history_length + data_length;
+ unsigned chunks = block_length / hop;
+ /* Stream position of block[0], and hop index of its first hop */
+ size_t origin = dec->position - dec->history_length;
+ size_t first_hop = dec->hop_count - dec->history_length / hop;
+ signed char *label = dec->label;
+ double sql_power = (double)sql_pulse * window / 2;
+ double bit_length[2] = {
+  (double)params->framerate * params->zero_cycles / params->zero_freq,
+  (double)params->framerate * params->ones_cycles / params->ones_freq
+ };
+ unsigned bit_cycles[2] = {params->zero_cycles,params->ones_cycles};
+ unsigned cyclefreq_length = dec->pending,bits,keep,settled;
+ size_t end,first,x;
+ 
+ kcs_correlate(block,chunks,hop / 2,hops,dec->reference,
+  dec->reference_length,sql_power * sql_power,dec->correlation,label);
+ 
+ /* Labels from the first hop not labelled before */
+ for(x = max(hops - 1,dec->hop_count - first_hop);x < chunks;x++){
+  KCS_COUNT(dec,crosses,1);
+  KCS_COUNT(dec,quiet,label[x] < 0);
+  if(label[x] == dec->run_tone)
+   continue;
+  first = x;
+  if(first_hop + x + 1 > hops){
+   if(label[x - 1] != label[x])
+    continue;
+   first = x - 1;
+  }
+  end = origin + (first + 1) * hop - window / 2;
+  if(dec->run_tone == 1){
+   if(first_hop + first > dec->carrier_next)
+    kcs_clock_carrier(dec,dec->correlation,dec->carrier_next - first_hop,
+     first - 1);
+   kcs_clock_turn(dec);
+  }
+  if(dec->run_tone >= 0){
+   cyclefreq_length = kcs_cycles_emit(dec,cyclefreq_length,end,0);
+   bits = dec->run_cycles / bit_cycles[dec->run_tone];
+   dec->span_nominal += bits * bit_length[dec->run_tone];
+   dec->span_open &= (bits >= 1 && bits <= 4);
+  }
+  if(label[x] == 0){
+   if(dec->span_open && dec->run_tone == 1)
+    kcs_clock_update(dec,(end - dec->span_start) / dec->span_nominal);
+   dec->span_open = (dec->run_tone >= 0);
+   dec->span_start = end;
+   dec->span_nominal = 0;
+  }else if(label[x] < 0)
+   dec->span_open = 0;
+  /* The first window reaches back to the start of the stream */
+  dec->run_tone = label[x];
+  dec->run_start = dec->run_last = (first_hop + x + 1 == hops)?0:end;
+  dec->run_first = first_hop + first;
+  dec->run_cycles = 0;
+  /* Phase turns are measured a window into a run */
+  dec->carrier_next = first_hop + first + hops;
+ }
+ 
+ /* The run in progress, as far as it goes, short of a last hop that may
+    be the first of the next run */
+ end = origin + chunks * hop - window / 2;
+ settled = chunks - (chunks >= hops && label[chunks - 1] != dec->run_tone);
+ if(dec->run_tone == 1 && first_hop + settled > dec->carrier_next){
+  kcs_clock_carrier(dec,dec->correlation,dec->carrier_next - first_hop,
+   settled - 1);
+  dec->carrier_next = first_hop + settled;
+ }
+ if(dec->run_tone >= 0 && chunks >= hops)
+  cyclefreq_length = kcs_cycles_emit(dec,cyclefreq_length,
+   final?origin + block_length - window / 2:end,final?1:-1);
+ 
+ /* Keeps two windows of hops and the unfinished one */
+ keep = min(chunks,hops * 2) * hop + block_length % hop;
+ memmove(dec->samples,block + block_length - keep,keep * sizeof(*block));
+ dec->history_length = keep;
+ dec->hop_count = first_hop + chunks;
+ return cyclefreq_length;
+}
+
+/* === FRAMING ===
+   Reads framed bytes out of cyclefreq. kcs_frame_bytes() is inlined into
+   one framer per preset with the cycle counts as constants, so the common
+   rates get loops the compiler can unroll, and a generic framer takes
+   them from the parameters. Returns the number of bytes. A byte the
+   cycles run out in the middle of cannot be told from a false start yet,
+   so its cycles stay pending at the front of cyclefreq for the next block
+   to complete, unless the stream has ended. */
+
+static inline __attribute__((always_inline)) unsigned kcs_frame_bytes(
+ struct kcs_decoder *dec,
+ unsigned cyclefreq_length,
+ int final,
+ const unsigned ones_cycles,
+ const unsigned zero_cycles
+){
+ unsigned char *cyclefreq = dec->cyclefreq;
+ size_t *cyclefreq_end = dec->cyclefreq_end;
+ char *text = dec->text;
+ unsigned text_length = 0;
+ unsigned pos1,pos2,pos3,x;
+ char decoded_byte;
+ 
+ pos1 = 0;
+ do{
+ 
+  /* Seek to the beginning of the start bit */
+  for(;(pos1 < cyclefreq_length)?(cyclefreq[pos1] == 1):0;pos1++);
+ 
+  /* Verify the start bit */
+  for(
+   pos2 = pos1;
+   (pos2 < cyclefreq_length)?
+   (pos1 + zero_cycles > pos2 && cyclefreq[pos2] == 0):0;
+   pos2++
+  );
+  if(pos2 == cyclefreq_length && pos1 + zero_cycles != pos2)
+   goto suspend;
+  if(pos1 + zero_cycles != pos2)
+   goto skip_bad;
+ 
+  /* Read the data bits */
+  for(decoded_byte = 0x0,x = 0x1;x <= 0x80;x <<= 1){
+   for(
+    pos3 = pos2;
+    (pos3 < cyclefreq_length)?
+    (pos2 + ones_cycles > pos3 && cyclefreq[pos3] == 1):0;
+    pos3++
+   );
+   if(pos2 + ones_cycles == pos3){
+    pos2 = pos3;
+    decoded_byte |= x;
+    continue;
+   }
+   if(pos3 == cyclefreq_length)
+    goto suspend;
+   for(
+    pos3 = pos2;
+    (pos3 < cyclefreq_length)?
+    (pos2 + zero_cycles > pos3 && cyclefreq[pos3] == 0):0;
+    pos3++
+   );
+   if(pos2 + zero_cycles == pos3)
+    pos2 = pos3;
+   else if(pos3 == cyclefreq_length)
+    goto suspend;
+  }
+ 
+  /* Verify stop bits */
+  for(
+   pos3 = pos2;
+   (pos3 < cyclefreq_length)?
+   (pos2 + ones_cycles * 2 > pos3 && cyclefreq[pos3] == 1):0;
+   pos3++
+  );
+  if(pos3 == cyclefreq_length && pos2 + ones_cycles * 2 != pos3)
+   goto suspend;
+  if(pos2 + ones_cycles * 2 != pos3)
+   goto skip_bad;
+ 
+  /* Append the value to text */
+  dec->text_pos[text_length] = pos1?cyclefreq_end[pos1 - 1]:dec->frame_origin;
+  text[text_length++] = decoded_byte;
+ 
+  pos1 = pos3;
+ 
+  continue;
+  suspend:
+  /* Out of cycles: wait for the rest of the byte */
+  if(!final)
+   break;
+  skip_bad:
+  if(pos1 < cyclefreq_length){
+   pos1 += zero_cycles;
+   KCS_COUNT(dec,resyncs,1);
+  }
+ 
+ }while(pos1 < cyclefreq_length);
+ 
+ /* Keeps the cycles from pos1 on */
+ if(pos1 > cyclefreq_length)
+  pos1 = cyclefreq_length;
+ if(pos1)
+  dec->frame_origin = cyclefreq_end[pos1 - 1];
+ dec->pending = cyclefreq_length - pos1;
+ memmove(cyclefreq,cyclefreq + pos1,dec->pending * sizeof(*cyclefreq));
+ memmove(cyclefreq_end,cyclefreq_end + pos1,
+  dec->pending * sizeof(*cyclefreq_end));
+ return text_length;
+}
+
+static unsigned kcs_frame_cuts(
+ struct kcs_decoder *dec,
+ unsigned cyclefreq_length,
+ int final
+){
+ return kcs_frame_bytes(dec,cyclefreq_length,final,2,1);
+}
+
+static unsigned kcs_frame_kcs300(
+ struct kcs_decoder *dec,
+ unsigned cyclefreq_length,
+ int final
+){
+ return kcs_frame_bytes(dec,cyclefreq_length,final,8,4);
+}
+
+static unsigned kcs_frame_any(
+ struct kcs_decoder *dec,
+ unsigned cyclefreq_length,
+ int final
+){
+ return kcs_frame_bytes(dec,cyclefreq_length,final,
+  dec->params.ones_cycles,dec->params.zero_cycles);
+}
+
+int kcs_decoder_init(
+ struct kcs_decoder *dec,
+ const struct kcs_params *input_params
+){
+ unsigned high_freq = max(input_params->ones_freq,input_params->zero_freq);
+ unsigned low_freq = min(input_params->ones_freq,input_params->zero_freq);
+ const struct kcs_params *params = &dec->params;
+ unsigned rate = input_params->framerate;
+ unsigned floor_rate = high_freq *
+  ((input_params->demodulator == KCS_DEMOD_GOERTZEL)?
+  KCS_GOERTZEL_SAMPLES:KCS_ZEROCROSS_SAMPLES);
+ 
+ memset(dec,0,sizeof(*dec));
+ /* Everything below divides by these */
+ if(
+  rate < KCS_RATE_MIN || rate > KCS_RATE_MAX ||
+  low_freq == 0 || low_freq == high_freq || high_freq >= rate / 2.0 ||
+  input_params->ones_cycles == 0 || input_params->zero_cycles == 0
+ )
+  return -1;
+ 
+ /* The largest factor that divides the rate and leaves the demodulator
+    enough samples a period, or the smallest that interpolates up to
+    that many */
+ dec->factor = rate / floor_rate;
+ while(dec->factor > 1 && rate % dec->factor)
+  dec->factor--;
+ dec->factor = max(1,dec->factor);
+ dec->up = (rate < floor_rate)?(floor_rate + rate - 1) / rate:1;
+ if(dec->factor > 1)
+  dec->tap_count = (dec->factor * KCS_DECIMATE_TAPS + 15) / 16 * 16;
+ else if(dec->up > 1){
+  dec->tap_count = dec->up * KCS_INTERPOLATE_TAPS;
+  dec->skip = (dec->tap_count - 1) / 2;
+ }
+ dec->rate = rate;
+ dec->params = *input_params;
+ dec->params.framerate = rate * dec->up / dec->factor;
+ dec->clock = 1;
+ dec->envelope = -1;
+ dec->cross = -1;
+ dec->run_tone = -1;
+ dec->demodulate = (params->demodulator == KCS_DEMOD_GOERTZEL)?
+  kcs_cycles_goertzel:kcs_cycles_zerocross;
+ if(params->ones_cycles == 2 && params->zero_cycles == 1)
+  dec->frame = kcs_frame_cuts;
+ else if(params->ones_cycles == 8 && params->zero_cycles == 4)
+  dec->frame = kcs_frame_kcs300;
+ else
+  dec->frame = kcs_frame_any;
+ dec->frame_cycles = params->zero_cycles +
+  8 * max(params->ones_cycles,params->zero_cycles) + 2 * params->ones_cycles;
+ if(params->gain == KCS_GAIN_AUTO)
+  dec->chunk_capacity = kcs_chunk_length(params);
+ /* Hops of about a quarter period of the higher tone, in fours, and a
+    window of about a period of the lower one; see kcs_cycles_goertzel */
+ dec->hop = max(1,round((double)params->framerate / high_freq) / 16) * 4;
+ dec->hops = max(1,round((double)params->framerate / low_freq / dec->hop));
+ if(params->demodulator == KCS_DEMOD_GOERTZEL)
+  dec->history_capacity = (dec->hops * 2 + 1) * dec->hop;
+ dec->window_capacity = kcs_decode_window(input_params);
+ 
+ pthread_once(&kcs_kernel_once,kcs_kernel_select);
+ 
+ dec->window = malloc(dec->window_capacity * sizeof(*dec->window));
+ dec->chunk = malloc(dec->chunk_capacity * sizeof(*dec->chunk) + 1);
+ if(
+  dec->window == NULL || dec->chunk == NULL ||
+  kcs_decoder_classes(dec) < 0 || kcs_decoder_references(dec) < 0 ||
+  (dec->tap_count && kcs_decoder_taps(dec) < 0) ||
+  kcs_decoder_scratch(dec,dec->window_capacity) < 0
+ ){
+  kcs_decoder_free(dec);
+  return -1;
+ }
+ return 0;
+}
+
+static char *kcs_decode_run(
+ struct kcs_decoder *dec,
+ const int16_t *data,
+ unsigned data_length,
+ int final,
+ unsigned *length
+){
+ /* Carries the block through decimation, conditioning, the demodulator
+    and the framer, each of which picks up where the last block left it */
+ int16_t sql_pulse = fmin(1.0,fmax(0.0,dec->params.squelch)) *
+  ((dec->params.gain == KCS_GAIN_AUTO)?KCS_AGC_LEVEL:INT16_MAX);
+ int16_t *buffer;
+ const int16_t *samples;
+ unsigned samples_length = data_length;
+ unsigned cyclefreq_length,x;
+ KCS_STOPWATCH(watch);
+ 
+ *length = 0;
+ if(data_length > dec->capacity && kcs_decoder_scratch(dec,data_length) < 0)
+  return NULL;
+ KCS_COUNT(dec,samples,data_length);
+ if(dec->factor > 1){
+  samples_length = kcs_decimate_block(dec,data,data_length,dec->resampled);
+  if(final)
+   samples_length += kcs_decimate_block(dec,NULL,(dec->tap_count - 1) / 2,
+    dec->resampled + samples_length);
+  data = dec->resampled;
+ }else if(dec->up > 1){
+  samples_length = kcs_interpolate_block(dec,data,data_length,
+   dec->resampled);
+  if(final)
+   samples_length += kcs_interpolate_block(dec,NULL,KCS_INTERPOLATE_TAPS / 2,
+    dec->resampled + samples_length);
+  data = dec->resampled;
+ }
+ KCS_LAP(dec,KCS_STAGE_DECIMATE,watch);
+ samples = buffer = dec->samples + dec->history_length;
+ 
+ /* === CYCLEFREQ DECODING === */
+ 
+ if(dec->params.gain == KCS_GAIN_AUTO)
+  samples_length = kcs_condition(dec,data,samples_length,buffer,final);
+ else if(dec->params.demodulator == KCS_DEMOD_GOERTZEL)
+  memcpy(buffer,data,samples_length * sizeof(*data));
+ else
+  samples = data;
+ KCS_LAP(dec,KCS_STAGE_CONDITION,watch);
+ cyclefreq_length = dec->demodulate(dec,samples,samples_length,sql_pulse,
+  final);
+ dec->position += samples_length;
+ KCS_COUNT(dec,cycles,cyclefreq_length - dec->pending);
+ KCS_LAP(dec,KCS_STAGE_DEMODULATE,watch);
+ 
+ /* ===TEXT DECODING === */
+ 
+ *length = dec->frame(dec,cyclefreq_length,final);
+ if(dec->tap_count)
+  for(x = 0;x < *length;x++)
+   dec->text_pos[x] = kcs_input_position(dec,dec->text_pos[x]);
+ KCS_COUNT(dec,bytes,*length);
+ KCS_LAP(dec,KCS_STAGE_FRAME,watch);
+ return dec->text;
+}
+
+char *kcs_decode_block(
+ struct kcs_decoder *dec,
+ const int16_t *data,
+ unsigned data_length,
+ unsigned *length
+){
+ /* Decodes a sample block and produces decoded characters as output. */
+ return kcs_decode_run(dec,data,data_length,0,length);
+}
+
+char *kcs_decode_end(struct kcs_decoder *dec,unsigned *length){
+ static const int16_t none[1];
+ 
+ return kcs_decode_run(dec,none,0,1,length);
+}
+
+unsigned kcs_decode_window(const struct kcs_params *params){
+ return 264 * fmax(
+  params->framerate * params->ones_cycles / params->ones_freq,
+  params->framerate * params->zero_cycles / params->zero_freq
+ );
+}
+
+static int kcs_decoder_queue(
+ struct kcs_decoder *dec,
+ const char *text,
+ unsigned text_length
+){
+ /* Appends decoded bytes to the queue for kcs_decoder_pull() */
+ if(text == NULL)
+  return -1;
+ if(kcs_queue_reserve((void **)&dec->queue,&dec->queue_start,
+  dec->queue_length,&dec->queue_capacity,text_length,sizeof(*dec->queue)) < 0)
+  return -1;
+ if(text_length)
+  memcpy(dec->queue + dec->queue_start + dec->queue_length,text,text_length);
+ dec->queue_length += text_length;
+ return 0;
+}
+
+int kcs_decoder_feed(
+ struct kcs_decoder *dec,
+ const int16_t *samples,
+ size_t length
+){
+ /* Gathers samples into whole windows, so the decoder's fixed costs
+    are paid once a window however finely the caller feeds it */
+ unsigned copy_length,text_length;
+ char *text;
+ 
+ while(length){
+  copy_length = dec->window_capacity - dec->window_length;
+  if(copy_length > length)
+   copy_length = length;
+  memcpy(dec->window + dec->window_length,samples,
+   copy_length * sizeof(*samples));
+  dec->window_length += copy_length;
+  samples += copy_length;
+  length -= copy_length;
+ 
+  if(dec->window_length == dec->window_capacity){
+   text = kcs_decode_block(dec,dec->window,dec->window_length,&text_length);
+   dec->window_length = 0;
+   if(kcs_decoder_queue(dec,text,text_length) < 0)
+    return -1;
+  }
+ }
+ return 0;
+}
+
+int kcs_decoder_finish(struct kcs_decoder *dec){
+ /* Decodes whatever is left after the last full window, and then what
+    the decoder holds at the end of the stream */
+ unsigned text_length;
+ char *text;
+ 
+ if(dec->window_length){
+  text = kcs_decode_block(dec,dec->window,dec->window_length,&text_length);
+  dec->window_length = 0;
+  if(kcs_decoder_queue(dec,text,text_length) < 0)
+   return -1;
+ }
+ text = kcs_decode_end(dec,&text_length);
+ return kcs_decoder_queue(dec,text,text_length);
+}
+
+size_t kcs_decoder_pull(struct kcs_decoder *dec,char *bytes,size_t max){
+ size_t length = (dec->queue_length < max)?dec->queue_length:max;
+ 
+ if(length == 0)
+  return 0;
+ memcpy(bytes,dec->queue + dec->queue_start,length);
+ dec->queue_start += length;
+ dec->queue_length -= length;
+ if(dec->queue_length == 0)
+  dec->queue_start = 0;
+ return length;
+}
+
+/* === FEC FRAMING ===
+   GF(256) is built on x^8 + x^4 + x^3 + x^2 + 1 with 2 as the primitive
+   element a, and the generator has the roots a^0 to a^31. Codewords are
+   shortened by leaving out leading zero symbols, so byte i of an n byte
+   codeword is the coefficient of x^(n - 1 - i). */
+#define KCS_GF_POLY 0x11D
+#define KCS_CRC_POLY 0xEDB88320 /* CRC32 as in zlib, reflected */
+
+static unsigned char kcs_gf_exp[512]; /* Doubled so log sums need no mod */
+static unsigned char kcs_gf_log[256];
+static uint32_t kcs_crc_table[256];
+static pthread_once_t kcs_fec_once = PTHREAD_ONCE_INIT;
+
+static unsigned char kcs_gf_mul(unsigned char a,unsigned char b){
+ if(a == 0 || b == 0)
+  return 0;
+ return kcs_gf_exp[kcs_gf_log[a] + kcs_gf_log[b]];
+}
+
+static unsigned char kcs_gf_div(unsigned char a,unsigned char b){
+ if(a == 0)
+  return 0;
+ return kcs_gf_exp[kcs_gf_log[a] + 255 - kcs_gf_log[b]];
+}
+
+static unsigned char kcs_gf_pow(unsigned power){
+ return kcs_gf_exp[power % 255];
+}
+
+static void kcs_fec_tables(void){
+ unsigned char generator[KCS_FEC_PARITY + 1];
+ unsigned x,y,value;
+ uint32_t crc;
+ 
+ for(x = 0,value = 1;x < 255;x++){
+  kcs_gf_exp[x] = kcs_gf_exp[x + 255] = value;
+  kcs_gf_log[value] = x;
+  value <<= 1;
+  if(value & 0x100)
+   value ^= KCS_GF_POLY;
+ }
+ 
+ /* The generator, lowest power first, one root at a time */
+ memset(generator,0,sizeof(generator));
+ generator[0] = 1;
+ for(x = 0;x < KCS_FEC_PARITY;x++){
+  for(y = x + 1;y > 0;y--)
+   generator[y] = generator[y - 1] ^ kcs_gf_mul(generator[y],kcs_gf_pow(x));
+  generator[0] = kcs_gf_mul(generator[0],kcs_gf_pow(x));
+ }
+ for(x = 0;x < 256;x++)
+  for(y = 0;y < KCS_FEC_PARITY;y++)
+   kcs_rs_table[x][y] = kcs_gf_mul(x,generator[KCS_FEC_PARITY - 1 - y]);
+ 
+ for(x = 0;x < 256;x++){
+  for(crc = x,y = 0;y < 8;y++)
+   crc = (crc & 1)?KCS_CRC_POLY ^ (crc >> 1):crc >> 1;
+  kcs_crc_table[x] = crc;
+ }
+}
+
+static uint32_t kcs_crc32(const unsigned char *data,unsigned data_length){
+ uint32_t crc = 0xFFFFFFFF;
+ unsigned x;
+ 
+ for(x = 0;x < data_length;x++)
+  crc = kcs_crc_table[(crc ^ data[x]) & 0xFF] ^ (crc >> 8);
+ return ~crc;
+}
+
+static int kcs_rs_correct(unsigned char *word,unsigned word_length){
+ /* Repairs a codeword in place, returning the number of bytes repaired
+    or -1 if there are too many to find: syndromes from the remainder,
+    the error locator by Berlekamp-Massey, its roots by Chien search and
+    the error values by Forney */
+ unsigned char rem[KCS_FEC_PARITY];
+ unsigned char syndrome[KCS_FEC_PARITY];
+ unsigned char locator[KCS_FEC_PARITY + 1],previous[KCS_FEC_PARITY + 1];
+ unsigned char saved[KCS_FEC_PARITY + 1],evaluator[KCS_FEC_PARITY];
+ unsigned char root[KCS_FEC_PARITY / 2];
+ unsigned position[KCS_FEC_PARITY / 2];
+ unsigned x,y,order = 0,shift = 1,roots = 0;
+ unsigned char s,discrepancy,last = 1,scale,value,slope;
+ 
+ memset(rem,0,sizeof(rem));
+ kcs_remainder(word,word_length,rem);
+ for(x = 0;x < KCS_FEC_PARITY && rem[x] == 0;x++);
+ if(x == KCS_FEC_PARITY)
+  return 0;
+ 
+ /* The remainder is the codeword times x^32, so S_j = R(a^j) / a^32j */
+ for(x = 0;x < KCS_FEC_PARITY;x++){
+  for(s = 0,y = 0;y < KCS_FEC_PARITY;y++)
+   s = kcs_gf_mul(s,kcs_gf_pow(x)) ^ rem[y];
+  syndrome[x] = kcs_gf_mul(s,kcs_gf_pow(255 - KCS_FEC_PARITY * x % 255));
+ }
+ 
+ memset(locator,0,sizeof(locator));
+ memset(previous,0,sizeof(previous));
+ locator[0] = previous[0] = 1;
+ for(x = 0;x < KCS_FEC_PARITY;x++){
+  discrepancy = syndrome[x];
+  for(y = 1;y <= order;y++)
+   discrepancy ^= kcs_gf_mul(locator[y],syndrome[x - y]);
+  if(discrepancy == 0){
+   shift++;
+   continue;
+  }
+  memcpy(saved,locator,sizeof(saved));
+  scale = kcs_gf_div(discrepancy,last);
+  for(y = 0;y + shift <= KCS_FEC_PARITY;y++)
+   locator[y + shift] ^= kcs_gf_mul(scale,previous[y]);
+  if(2 * order <= x){
+   order = x + 1 - order;
+   memcpy(previous,saved,sizeof(previous));
+   last = discrepancy;
+   shift = 1;
+  }else
+   shift++;
+ }
+ if(order > KCS_FEC_PARITY / 2)
+  return -1;
+ 
+ /* Byte i is damaged if the locator vanishes at a^-(n - 1 - i) */
+ for(x = 0;x < word_length;x++){
+  value = kcs_gf_pow(255 - (word_length - 1 - x) % 255);
+  for(s = 0,y = order + 1;y > 0;y--)
+   s = kcs_gf_mul(s,value) ^ locator[y - 1];
+  if(s == 0){
+   if(roots == order)
+    return -1;
+   root[roots] = value;
+   position[roots++] = x;
+  }
+ }
+ if(roots != order)
+  return -1;
+ 
+ /* Forney: the error is X * evaluator(1/X) / locator'(1/X) */
+ for(x = 0;x < KCS_FEC_PARITY;x++)
+  for(evaluator[x] = 0,y = 0;y <= x && y <= order;y++)
+   evaluator[x] ^= kcs_gf_mul(syndrome[x - y],locator[y]);
+ for(x = 0;x < roots;x++){
+  for(s = 0,y = KCS_FEC_PARITY;y > 0;y--)
+   s = kcs_gf_mul(s,root[x]) ^ evaluator[y - 1];
+  for(slope = 0,y = (order + 1) | 1;y > 1;){
+   y -= 2;
+   slope = kcs_gf_mul(slope,kcs_gf_mul(root[x],root[x])) ^ locator[y];
+  }
+  if(slope == 0)
+   return -1;
+  word[position[x]] ^= kcs_gf_div(kcs_gf_div(s,slope),root[x]);
+ }
+ return roots;
+}
+
+unsigned kcs_fec_frame(
+ const char *payload,
+ unsigned length,
+ unsigned sequence,
+ char *frame
+){
+ unsigned char *out = (unsigned char *)frame;
+ unsigned char *word = out + KCS_FEC_HEADER;
+ unsigned data_length = length + KCS_FEC_FIELDS;
+ uint32_t crc;
+ 
+ if(length == 0 || length > KCS_FEC_PAYLOAD)
+  return 0;
+ pthread_once(&kcs_kernel_once,kcs_kernel_select);
+ pthread_once(&kcs_fec_once,kcs_fec_tables);
+ 
+ out[0] = KCS_FEC_SYNC0;
+ out[1] = KCS_FEC_SYNC1;
+ out[2] = out[3] = out[4] = length;
+ word[0] = length;
+ word[1] = sequence & 0xFF;
+ word[2] = (sequence >> 8) & 0xFF;
+ memcpy(word + 3,payload,length);
+ crc = kcs_crc32(word,length + 3);
+ word[length + 3] = crc & 0xFF;
+ word[length + 4] = (crc >> 8) & 0xFF;
+ word[length + 5] = (crc >> 16) & 0xFF;
+ word[length + 6] = (crc >> 24) & 0xFF;
+ memset(word + data_length,0,KCS_FEC_PARITY);
+ kcs_remainder(word,data_length,word + data_length);
+ return KCS_FEC_HEADER + data_length + KCS_FEC_PARITY;
+}
+
+void kcs_fec_decoder_init(struct kcs_fec_decoder *fec){
+ memset(fec,0,sizeof(*fec));
+ pthread_once(&kcs_kernel_once,kcs_kernel_select);
+ pthread_once(&kcs_fec_once,kcs_fec_tables);
+}
+
+static unsigned kcs_fec_need(const unsigned char *frame,unsigned length){
+ /* Bytes the frame at the front takes, or 0 if it is not a frame. The
+    length bytes are voted on bit by bit. */
+ unsigned payload_length;
+ 
+ if(
+  (length > 0 && frame[0] != KCS_FEC_SYNC0) ||
+  (length > 1 && frame[1] != KCS_FEC_SYNC1)
+ )
+  return 0;
+ if(length < KCS_FEC_HEADER)
+  return KCS_FEC_HEADER;
+ payload_length = (frame[2] & frame[3]) | (frame[2] & frame[4]) |
+  (frame[3] & frame[4]);
+ if(payload_length == 0 || payload_length > KCS_FEC_PAYLOAD)
+  return 0;
+ return KCS_FEC_HEADER + KCS_FEC_FIELDS + payload_length + KCS_FEC_PARITY;
+}
+
+static int kcs_fec_check(unsigned char *word,unsigned word_length){
+ /* Repairs a codeword in place and checks its length and CRC, returning
+    the number of bytes repaired or -1 */
+ unsigned payload_length = word_length - KCS_FEC_FIELDS - KCS_FEC_PARITY;
+ uint32_t crc;
+ int repaired;
+ 
+ repaired = kcs_rs_correct(word,word_length);
+ if(repaired < 0 || word[0] != payload_length)
+  return -1;
+ crc = word[payload_length + 3] | word[payload_length + 4] << 8 |
+  word[payload_length + 5] << 16 | (uint32_t)word[payload_length + 6] << 24;
+ if(kcs_crc32(word,payload_length + 3) != crc)
+  return -1;
+ return repaired;
+}
+
+static int kcs_fec_open(
+ struct kcs_fec_decoder *fec,
+ unsigned frame_length,
+ char *payload,
+ unsigned *used
+){
+ /* Opens the frame held, writing out its payload. The framer drops a
+    byte it cannot frame, which moves the rest of the frame down by one
+    and brings in the first byte of the next; so a frame that does not
+    open as it is, or only does by repairing a last byte that looks like
+    a sync word, is tried with a blank byte put back at each place in
+    turn, to be repaired along with the rest. */
+ const unsigned char *held = fec->frame + KCS_FEC_HEADER;
+ unsigned char word[255],slipped[255];
+ unsigned word_length = frame_length - KCS_FEC_HEADER;
+ unsigned payload_length = word_length - KCS_FEC_FIELDS - KCS_FEC_PARITY;
+ unsigned sequence,x;
+ int repaired,slip_repaired;
+ 
+ memcpy(word,held,word_length);
+ repaired = kcs_fec_check(word,word_length);
+ *used = frame_length;
+ if(
+  repaired < 0 ||
+  (word[word_length - 1] != held[word_length - 1] &&
+  held[word_length - 1] == KCS_FEC_SYNC0)
+ )
+  for(x = 0;x < word_length;x++){
+   memcpy(slipped,held,x);
+   slipped[x] = 0;
+   memcpy(slipped + x + 1,held + x,word_length - 1 - x);
+   if((slip_repaired = kcs_fec_check(slipped,word_length)) >= 0){
+    memcpy(word,slipped,word_length);
+    repaired = slip_repaired;
+    *used = frame_length - 1;
+    break;
+   }
+  }
+ if(repaired < 0)
+  return -1;
+ 
+ sequence = word[1] | word[2] << 8;
+ if(fec->started)
+  fec->missed += (sequence - fec->sequence) & 0xFFFF;
+ fec->sequence = (sequence + 1) & 0xFFFF;
+ fec->started = 1;
+ fec->frames++;
+ fec->corrected += repaired;
+ memcpy(payload,word + 3,payload_length);
+ return payload_length;
+}
+
+unsigned kcs_fec_deframe(
+ struct kcs_fec_decoder *fec,
+ const char *bytes,
+ unsigned length,
+ char *payload
+){
+ /* A frame that fails is given up from its first byte only, since the
+    next real sync word may be inside it */
+ unsigned x,y,need,used,payload_length = 0;
+ int opened;
+ 
+ for(x = 0;x < length;x++){
+  fec->frame[fec->length++] = bytes[x];
+  for(;;){
+   need = kcs_fec_need(fec->frame,fec->length);
+   if(need > fec->length)
+    break;
+   if(need && (opened = kcs_fec_open(fec,need,payload + payload_length,
+    &used)) >= 0){
+    payload_length += opened;
+    y = used;
+   }else{
+    fec->failed += need != 0;
+    for(y = 1;y < fec->length && fec->frame[y] != KCS_FEC_SYNC0;y++);
+   }
+   memmove(fec->frame,fec->frame + y,fec->length - y);
+   fec->length -= y;
+  }
+ }
+ return payload_length;
+}
@@ -0,0 +1,609 @@
+/* KiloCycleS loopback test
+
+   Encodes payloads in memory and checks that they decode back exactly,
+   for each wave shape and demodulator: through the block calls, with
+   whole windows and with short blocks of random length that split bytes
+   anywhere; through the streaming feed/pull calls with uneven chunk
+   sizes; and through the block calls again with the level fading over
+   a DC offset, and played back 10% slow and fast. Framed payloads are
+   sent through too and damaged on the way back, to check that the
+   frames that can be are repaired and the others dropped. The tones are
+   checked for their exact frequencies, and round trips made, at other
+   sample rates as well, from 8 kHz, which the decoder interpolates, up
+   to 192 kHz, which it decimates by factors up to 20, and rates and
+   tones outside what the decoder works with are checked to be refused.
+
+   Every run goes ahead whatever the others do; each mismatch is printed
+   as it is found, and the count of runs passed at the end. Exits
+   non-zero if any failed. No sound card or files are involved.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "kcs.h"
+
+#define LOOPBACK_CLEAN 0
+#define LOOPBACK_FADE 1
+#define LOOPBACK_SLOW 2
+#define LOOPBACK_FAST 3
+
+static const char *loopback_names[] = {"block","fade","slow","fast"};
+
+static uint32_t loopback_seed = 1;
+
+static uint32_t loopback_random(void){
+ loopback_seed ^= loopback_seed << 13;
+ loopback_seed ^= loopback_seed >> 17;
+ loopback_seed ^= loopback_seed << 5;
+ return loopback_seed;
+}
+
+static int loopback_check(
+ const char *name,
+ const struct kcs_params *params,
+ const char *payload,
+ size_t payload_length,
+ const char *text,
+ size_t text_length
+){
+ size_t x;
+ 
+ if(text_length == payload_length && memcmp(text,payload,text_length) == 0)
+  return 0;
+ for(x = 0;x < text_length && x < payload_length;x++)
+  if(text[x] != payload[x])
+   break;
+ fprintf(stderr,
+  "FAIL %s: %u Hz, %u/%u cycles, wave %d demodulator %d null %u; "
+  "%zu bytes in, %zu out, first difference at %zu\n",
+  name,params->framerate,params->ones_cycles,params->zero_cycles,
+  params->wave,params->demodulator,params->null_cycles,
+  payload_length,text_length,x);
+ return -1;
+}
+
+static int loopback_block(
+ const struct kcs_params *params,
+ const char *payload,
+ size_t payload_length,
+ unsigned window,
+ int channel
+){
+ /* Encodes with kcs_encode_block_into() between a leader and trailer,
+    then walks the samples window by window with kcs_decode_block(), or in
+    blocks of 1 to 300 samples for a window of 0. With
+    LOOPBACK_FADE the level falls to a twentieth and back, over a DC
+    offset; LOOPBACK_SLOW and LOOPBACK_FAST resample it as a tape played
+    at 0.9 or 1.1 times its speed. The payload is synthesised again in
+    two calls split at random, as 32-bit samples, and the whole stream
+    is pulled from kcs_encoder_pull() of an encoder sharing the first
+    one's wavetable, in chunks of random length; both must come out the
+    same. */
+ struct kcs_encoder enc,stream;
+ struct kcs_encode_state state = {0},wide_state;
+ struct kcs_decoder dec;
+ int16_t *data = NULL,*leader = NULL,*trailer = NULL,*played = NULL;
+ int16_t chunk[5000];
+ int32_t *wide = NULL;
+ unsigned leader_length,trailer_length,block_length,block_text,split;
+ size_t data_length,text_length = 0,pos = 0,x,y;
+ double step,at;
+ char *text = NULL,*block;
+ int ret = -1;
+ 
+ if(kcs_encoder_init(&enc,params) < 0)
+  return -1;
+ if(kcs_decoder_init(&dec,params) < 0){
+  kcs_encoder_free(&enc);
+  return -1;
+ }
+ kcs_encoder_share(&stream,&enc);
+ /* Carriers are whole seconds, and so whole samples, from anywhere
+    within a sample */
+ leader = kcs_encode_carrier(&enc,&state,params->leader,&leader_length);
+ wide_state = state;
+ data_length = leader_length +
+  kcs_encode_block_length(&enc,&state,payload,payload_length) +
+  (size_t)params->trailer * params->framerate;
+ data = malloc(data_length * sizeof(*data));
+ text = malloc(payload_length + 1);
+ wide = malloc(data_length * sizeof(*wide));
+ if(!leader || !data || !text || !wide)
+  goto block_end;
+ 
+ memcpy(data,leader,leader_length * sizeof(*data));
+ pos = leader_length;
+ pos += kcs_encode_block_into(&enc,&state,payload,payload_length,data + pos);
+ trailer = kcs_encode_carrier(&enc,&state,params->trailer,&trailer_length);
+ if(trailer == NULL)
+  goto block_end;
+ if(pos + trailer_length != data_length){
+  fprintf(stderr,"FAIL block: length differs\n");
+  goto block_end;
+ }
+ memcpy(data + pos,trailer,trailer_length * sizeof(*data));
+ 
+ split = loopback_random() % (payload_length + 1);
+ y = kcs_encode_block_into32(&enc,&wide_state,payload,split,wide);
+ y += kcs_encode_block_into32(&enc,&wide_state,payload + split,
+  payload_length - split,wide + y);
+ if(y != pos - leader_length){
+  fprintf(stderr,"FAIL wide: length differs\n");
+  goto block_end;
+ }
+ for(x = 0;x < pos - leader_length;x++)
+  if(wide[x] != data[leader_length + x]){
+   fprintf(stderr,"FAIL wide: sample %zu differs\n",x);
+   goto block_end;
+  }
+ 
+ if(
+  kcs_encoder_feed(&stream,payload,split) < 0 ||
+  kcs_encoder_feed(&stream,payload + split,payload_length - split) < 0 ||
+  kcs_encoder_finish(&stream) < 0 || stream.length != data_length
+ ){
+  fprintf(stderr,"FAIL pull: length differs\n");
+  goto block_end;
+ }
+ for(x = 0;(y = kcs_encoder_pull(&stream,chunk,
+  1 + loopback_random() % (sizeof(chunk) / sizeof(*chunk)))) > 0;x += y)
+  if(memcmp(chunk,data + x,y * sizeof(*chunk)) != 0){
+   fprintf(stderr,"FAIL pull: samples from %zu differ\n",x);
+   goto block_end;
+  }
+ 
+ for(x = 0;channel == LOOPBACK_FADE && x < data_length;x++)
+  data[x] = data[x] * (0.05 + 0.95 * (0.5 + 0.5 *
+   cos(2 * M_PI * x / data_length))) + 3000;
+ 
+ if(channel == LOOPBACK_SLOW || channel == LOOPBACK_FAST){
+  step = (channel == LOOPBACK_SLOW)?0.9:1.1;
+  if((played = malloc((data_length / step + 1) * sizeof(*played))) == NULL)
+   goto block_end;
+  for(x = 0,at = 0;at < data_length - 1;x++,at = x * step){
+   y = at;
+   played[x] = data[y] + (data[y + 1] - data[y]) * (at - y);
+  }
+  free(data);
+  data = played;
+  played = NULL;
+  data_length = x;
+ }
+ 
+ for(pos = 0;;pos += block_length){
+  block_length = window?window:1 + loopback_random() % 300;
+  if(block_length > data_length - pos)
+   block_length = data_length - pos;
+  if(block_length)
+   block = kcs_decode_block(&dec,data + pos,block_length,&block_text);
+  else
+   block = kcs_decode_end(&dec,&block_text);
+  if(block == NULL){
+   fprintf(stderr,"FAIL block: out of memory\n");
+   goto block_end;
+  }
+  if(text_length + block_text > payload_length){
+   text_length += block_text;
+   break;
+  }
+  memcpy(text + text_length,block,block_text);
+  text_length += block_text;
+  if(block_length == 0)
+   break;
+ }
+ ret = loopback_check(loopback_names[channel],params,payload,payload_length,
+  text,text_length);
+ 
+ /* With KCS_STATS every sample and byte is counted once */
+ if(ret == 0 && kcs_stats_enabled() &&
+  (dec.stats.samples != data_length || dec.stats.bytes != text_length)){
+  fprintf(stderr,"FAIL stats: %llu samples and %llu bytes counted\n",
+   (unsigned long long)dec.stats.samples,
+   (unsigned long long)dec.stats.bytes);
+  ret = -1;
+ }
+ 
+ block_end:
+ kcs_encoder_free(&stream);
+ kcs_encoder_free(&enc);
+ kcs_decoder_free(&dec);
+ free(leader);
+ free(trailer);
+ free(data);
+ free(text);
+ free(wide);
+ return ret;
+}
+
+static int loopback_tone(const struct kcs_params *params){
+ /* A second of carrier is exactly ones_freq cycles, and a block of NULs
+    lasts its bits to within a sample */
+ struct kcs_encoder enc;
+ struct kcs_encode_state state = {0};
+ char block[100];
+ int16_t *data;
+ unsigned length,crosses = 0,x;
+ double duration;
+ 
+ if(kcs_encoder_init(&enc,params) < 0)
+  return -1;
+ if((data = kcs_encode_carrier(&enc,&state,1,&length)) == NULL){
+  kcs_encoder_free(&enc);
+  return -1;
+ }
+ for(x = 1;x < length;x++)
+  crosses += data[x - 1] >= 0 && data[x] < 0;
+ memset(block,0,sizeof(block));
+ duration = sizeof(block) * params->framerate *
+  (9.0 * params->zero_cycles / params->zero_freq +
+  2.0 * params->ones_cycles / params->ones_freq);
+ length = kcs_encode_block_length(&enc,&state,block,sizeof(block));
+ free(data);
+ kcs_encoder_free(&enc);
+ 
+ if(crosses == params->ones_freq && fabs(length - duration) <= 1)
+  return 0;
+ fprintf(stderr,"FAIL tone: %u Hz, wave %d; %u cycles a second, "
+  "%u samples for %.1f\n",params->framerate,params->wave,crosses,length,
+  duration);
+ return -1;
+}
+
+static int loopback_dropout(const struct kcs_params *params){
+ /* Cuts a stream into bursts with dropouts between them, which
+    demodulate to runs cut short after cycles of them were emitted, and
+    checks that the bytes decoded from it, whatever they are, start in
+    order and within the samples given so far */
+ struct kcs_encoder enc;
+ struct kcs_decoder dec;
+ char payload[256];
+ int16_t *data = NULL;
+ unsigned window,block_length,text_length,x;
+ size_t data_length,pos,last = 0;
+ int ret = -1;
+ 
+ for(x = 0;x < sizeof(payload);x++)
+  payload[x] = x;
+ if(kcs_encoder_init(&enc,params) < 0)
+  return -1;
+ if(kcs_decoder_init(&dec,params) < 0){
+  kcs_encoder_free(&enc);
+  return -1;
+ }
+ if(
+  kcs_encoder_feed(&enc,payload,sizeof(payload)) < 0 ||
+  kcs_encoder_finish(&enc) < 0 ||
+  (data = malloc((data_length = enc.length) * sizeof(*data))) == NULL ||
+  kcs_encoder_pull(&enc,data,data_length) != data_length
+ )
+  goto dropout_end;
+ for(pos = 0;pos < data_length;pos++)
+  if(pos % 568 < 278)
+   data[pos] = 0;
+ 
+ window = kcs_decode_window(params) / 8;
+ for(pos = 0;;pos += block_length){
+  block_length = (data_length - pos < window)?data_length - pos:window;
+  if((block_length?kcs_decode_block(&dec,data + pos,block_length,
+   &text_length):kcs_decode_end(&dec,&text_length)) == NULL)
+   goto dropout_end;
+  for(x = 0;x < text_length;x++){
+   if(dec.text_pos[x] < last || dec.text_pos[x] >= pos + block_length){
+    fprintf(stderr,"FAIL dropout: %u Hz, wave %d demodulator %d; byte "
+     "at %zu after one at %zu, with %zu samples given\n",params->framerate,
+     params->wave,params->demodulator,dec.text_pos[x],last,
+     pos + block_length);
+    goto dropout_end;
+   }
+   last = dec.text_pos[x];
+  }
+  if(block_length == 0)
+   break;
+ }
+ ret = 0;
+ 
+ dropout_end:
+ kcs_encoder_free(&enc);
+ kcs_decoder_free(&dec);
+ free(data);
+ return ret;
+}
+
+static int loopback_stream(
+ const struct kcs_params *params,
+ const char *payload,
+ size_t payload_length
+){
+ /* Feeds bytes and samples through in randomly sized chunks */
+ struct kcs_encoder enc;
+ struct kcs_decoder dec;
+ int16_t samples[5000];
+ char *text = NULL;
+ size_t text_length = 0,pos = 0,chunk,length;
+ int finished = 0,ret = -1;
+ 
+ if(kcs_encoder_init(&enc,params) < 0)
+  return -1;
+ if(kcs_decoder_init(&dec,params) < 0){
+  kcs_encoder_free(&enc);
+  return -1;
+ }
+ if((text = malloc(payload_length + 4096)) == NULL)
+  goto stream_end;
+ 
+ while(!finished){
+  if(pos < payload_length){
+   chunk = loopback_random() % 300;
+   if(chunk > payload_length - pos)
+    chunk = payload_length - pos;
+   if(kcs_encoder_feed(&enc,payload + pos,chunk) < 0)
+    goto stream_end;
+   pos += chunk;
+  }else{
+   if(kcs_encoder_finish(&enc) < 0)
+    goto stream_end;
+   finished = 1;
+  }
+  while((length = kcs_encoder_pull(&enc,samples,
+   1 + loopback_random() % 5000)) > 0)
+   if(kcs_decoder_feed(&dec,samples,length) < 0)
+    goto stream_end;
+  if(finished && kcs_decoder_finish(&dec) < 0)
+   goto stream_end;
+  while(text_length < payload_length + 4096 && (length = kcs_decoder_pull(
+   &dec,text + text_length,payload_length + 4096 - text_length)) > 0)
+   text_length += length;
+ }
+ ret = loopback_check("stream",params,payload,payload_length,text,text_length);
+ 
+ stream_end:
+ kcs_encoder_free(&enc);
+ kcs_decoder_free(&dec);
+ free(text);
+ return ret;
+}
+
+static int loopback_fec(
+ const struct kcs_params *params,
+ const char *payload,
+ size_t payload_length
+){
+ /* Frames the payload and sends it through the modem, then damages the
+    bytes that come back, frame by frame in fours: as many bytes replaced
+    as can be repaired, none, too many, and one byte dropped with a
+    length byte and others replaced and noise ahead of the frame. These
+    are deframed in random chunks, and all but the third of each four
+    must come out. */
+ struct kcs_encoder enc;
+ struct kcs_decoder dec;
+ struct kcs_fec_decoder fec;
+ size_t frames = (payload_length + KCS_FEC_PAYLOAD - 1) / KCS_FEC_PAYLOAD;
+ size_t sent_length = 0,received_length = 0,damaged_length = 0;
+ size_t expected_length = 0,text_length = 0,pos,chunk,x;
+ unsigned *frame_length = NULL,y,errors,dropped = 0;
+ char *sent = NULL,*received = NULL,*damaged = NULL,*expected = NULL;
+ char *text = NULL;
+ int16_t samples[5000];
+ int ret = -1;
+ 
+ if(kcs_encoder_init(&enc,params) < 0)
+  return -1;
+ if(kcs_decoder_init(&dec,params) < 0){
+  kcs_encoder_free(&enc);
+  return -1;
+ }
+ kcs_fec_decoder_init(&fec);
+ frame_length = malloc(frames * sizeof(*frame_length));
+ sent = malloc(frames * KCS_FEC_FRAME);
+ received = malloc(frames * KCS_FEC_FRAME + 4096);
+ damaged = malloc(frames * (KCS_FEC_FRAME + 8));
+ expected = malloc(payload_length);
+ text = malloc(payload_length + 300 + KCS_FEC_PAYLOAD);
+ if(!frame_length || !sent || !received || !damaged || !expected || !text)
+  goto fec_end;
+ 
+ for(x = 0;x < frames;x++){
+  chunk = payload_length - x * KCS_FEC_PAYLOAD;
+  if(chunk > KCS_FEC_PAYLOAD)
+   chunk = KCS_FEC_PAYLOAD;
+  frame_length[x] = kcs_fec_frame(payload + x * KCS_FEC_PAYLOAD,chunk,x,
+   sent + sent_length);
+  sent_length += frame_length[x];
+  if(x % 4 != 2){
+   memcpy(expected + expected_length,payload + x * KCS_FEC_PAYLOAD,chunk);
+   expected_length += chunk;
+  }else if(x + 1 < frames)
+   dropped++;
+ }
+ 
+ if(kcs_encoder_feed(&enc,sent,sent_length) < 0 ||
+  kcs_encoder_finish(&enc) < 0)
+  goto fec_end;
+ while((chunk = kcs_encoder_pull(&enc,samples,5000)) > 0)
+  if(kcs_decoder_feed(&dec,samples,chunk) < 0)
+   goto fec_end;
+ if(kcs_decoder_finish(&dec) < 0)
+  goto fec_end;
+ while((chunk = kcs_decoder_pull(&dec,received + received_length,
+  frames * KCS_FEC_FRAME + 4096 - received_length)) > 0)
+  received_length += chunk;
+ if(received_length != sent_length ||
+  memcmp(received,sent,sent_length) != 0){
+  fprintf(stderr,"FAIL fec: frames did not come through the modem\n");
+  goto fec_end;
+ }
+ 
+ /* Replaced bytes are spread over the codeword so that each counts once */
+ for(pos = 0,x = 0;x < frames;pos += frame_length[x++]){
+  memcpy(damaged + damaged_length,received + pos,frame_length[x]);
+  errors = (x % 4 == 0)?KCS_FEC_PARITY / 2:(x % 4 == 2)?40:
+   (x % 4 == 3)?10:0;
+  for(y = 0;y < errors;y++)
+   damaged[damaged_length + KCS_FEC_HEADER + y *
+    (frame_length[x] - KCS_FEC_HEADER) / errors] ^= 1 + loopback_random() % 255;
+  if(x % 4 == 3){
+   damaged[damaged_length + 3] ^= 1 + loopback_random() % 255;
+   memmove(damaged + damaged_length + 8,damaged + damaged_length,
+    frame_length[x]);
+   for(y = 0;y < 8;y++)
+    damaged[damaged_length + y] = loopback_random();
+   damaged_length += 8;
+   y = 20 + loopback_random() % (frame_length[x] - 20);
+   memmove(damaged + damaged_length + y,damaged + damaged_length + y + 1,
+    frame_length[x] - y - 1);
+   damaged_length--;
+  }
+  damaged_length += frame_length[x];
+ }
+ 
+ for(pos = 0;pos < damaged_length;pos += chunk){
+  chunk = 1 + loopback_random() % 300;
+  if(chunk > damaged_length - pos)
+   chunk = damaged_length - pos;
+  if(text_length + chunk + KCS_FEC_PAYLOAD > payload_length + 300 +
+   KCS_FEC_PAYLOAD){
+   text_length = payload_length + 1;
+   break;
+  }
+  text_length += kcs_fec_deframe(&fec,damaged + pos,chunk,text + text_length);
+ }
+ if(fec.missed != dropped){
+  fprintf(stderr,"FAIL fec: %lu frames missing, %u dropped\n",fec.missed,
+   dropped);
+  goto fec_end;
+ }
+ ret = loopback_check("fec",params,expected,expected_length,text,text_length);
+ 
+ fec_end:
+ kcs_encoder_free(&enc);
+ kcs_decoder_free(&dec);
+ free(frame_length);
+ free(sent);
+ free(received);
+ free(damaged);
+ free(expected);
+ free(text);
+ return ret;
+}
+
+static int loopback_refuse(void){
+ /* Frame rates and tones the decoder cannot work with are turned away
+    before anything divides by them */
+ static const unsigned params_list[][5] = {
+  /* Frame rate, ones and zero frequencies and cycles */
+  {0,2400,1200,2,1},{4000,2400,1200,2,1},{384000,2400,1200,2,1},
+  {44100,0,1200,2,1},{44100,2400,0,2,1},{44100,1200,1200,2,1},
+  {8000,4800,1200,2,1},{44100,2400,1200,0,1},{44100,2400,1200,2,0}
+ };
+ struct kcs_params params;
+ struct kcs_decoder dec;
+ unsigned x;
+ int ret = 0;
+ 
+ for(x = 0;x < sizeof(params_list) / sizeof(*params_list);x++){
+  kcs_params_default(&params);
+  params.framerate = params_list[x][0];
+  params.ones_freq = params_list[x][1];
+  params.zero_freq = params_list[x][2];
+  params.ones_cycles = params_list[x][3];
+  params.zero_cycles = params_list[x][4];
+  if(kcs_decoder_init(&dec,&params) == 0){
+   fprintf(stderr,"FAIL refuse: %u Hz, %u/%u Hz, %u/%u cycles taken\n",
+    params.framerate,params.ones_freq,params.zero_freq,params.ones_cycles,
+    params.zero_cycles);
+   kcs_decoder_free(&dec);
+   ret = -1;
+  }
+ }
+ return ret;
+}
+
+int main(void){
+ static const size_t lengths[] = {1,2,255,256,1000,20000};
+ static const char *presets[] = {"1200","300","2000:3:1000:2"};
+ static const unsigned rates[] = {
+  8000,11025,16000,22050,32000,48000,88200,96000,192000
+ };
+ struct kcs_params params;
+ char payload[20000];
+ unsigned x,y,window,preset;
+ int wave,demodulator,null_pulse,channel,failures = 0,runs = 0;
+ 
+ for(preset = 0;preset < sizeof(presets) / sizeof(*presets);preset++)
+ for(wave = KCS_WAVE_SINE;wave <= KCS_WAVE_SQUARE;wave++)
+ for(demodulator = KCS_DEMOD_ZEROCROSS;demodulator <= KCS_DEMOD_GOERTZEL;
+  demodulator++)
+ for(null_pulse = 0;null_pulse <= 1;null_pulse++)
+ for(x = 0;x < sizeof(lengths) / sizeof(*lengths);x++){
+  kcs_params_default(&params);
+  kcs_params_preset(&params,presets[preset]);
+  params.wave = wave;
+  params.demodulator = demodulator;
+  params.leader = params.trailer = 1;
+  if(!null_pulse)
+   params.null_cycles = 0;
+ 
+  /* Every byte value, then random bytes */
+  for(y = 0;y < lengths[x];y++)
+   payload[y] = (y < 256)?y:loopback_random();
+ 
+  /* The default window, and short blocks that split bytes often */
+  window = kcs_decode_window(&params);
+  failures += loopback_block(&params,payload,lengths[x],window,
+   LOOPBACK_CLEAN) < 0;
+  failures += loopback_block(&params,payload,lengths[x],0,
+   LOOPBACK_CLEAN) < 0;
+  failures += loopback_stream(&params,payload,lengths[x]) < 0;
+  failures += loopback_fec(&params,payload,lengths[x]) < 0;
+  for(channel = LOOPBACK_FADE;channel <= LOOPBACK_FAST;channel++)
+   failures += loopback_block(&params,payload,lengths[x],window,channel) < 0;
+  runs += 7;
+ }
+ 
+ /* Byte positions stay in order through dropouts */
+ for(wave = KCS_WAVE_SINE;wave <= KCS_WAVE_SQUARE;wave++)
+ for(demodulator = KCS_DEMOD_ZEROCROSS;demodulator <= KCS_DEMOD_GOERTZEL;
+  demodulator++){
+  kcs_params_default(&params);
+  params.wave = wave;
+  params.demodulator = demodulator;
+  params.leader = params.trailer = 1;
+  failures += loopback_dropout(&params) < 0;
+  runs++;
+ }
+ 
+ /* Exact tones and round trips, off speed too, at the other common rates */
+ for(x = 0;x < sizeof(rates) / sizeof(*rates);x++)
+ for(wave = KCS_WAVE_SINE;wave <= KCS_WAVE_SQUARE;wave++)
+ for(demodulator = KCS_DEMOD_ZEROCROSS;demodulator <= KCS_DEMOD_GOERTZEL;
+  demodulator++){
+  kcs_params_default(&params);
+  params.framerate = rates[x];
+  params.wave = wave;
+  params.demodulator = demodulator;
+  params.leader = params.trailer = 1;
+  for(y = 0;y < 1000;y++)
+   payload[y] = (y < 256)?y:loopback_random();
+ 
+  failures += loopback_tone(&params) < 0;
+  failures += loopback_block(&params,payload,1000,kcs_decode_window(&params),
+   LOOPBACK_CLEAN) < 0;
+  failures += loopback_block(&params,payload,1000,0,LOOPBACK_CLEAN) < 0;
+  failures += loopback_stream(&params,payload,1000) < 0;
+  for(channel = LOOPBACK_FADE;channel <= LOOPBACK_FAST;channel++)
+   failures += loopback_block(&params,payload,1000,
+    kcs_decode_window(&params),channel) < 0;
+  runs += 7;
+ }
+ 
+ /* Parameters the decoder cannot work with */
+ failures += loopback_refuse() < 0;
+ runs++;
+ 
+ printf("%d of %d loopback runs passed\n",runs - failures,runs);
+ return failures?1:0;
+}